@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "sound.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "musicator_control.h"
+
+// TODO make configurable?
+#define CONTROL_CAPACITY (1024 * 16)
+#define CONTROL_MAX_NAMES 1024
+
+typedef struct ControlServer {
+    AudioContext* ctx;
+
+    char* shm_name;
+    ControlHeader* h;
+    size_t size;
+
+    pthread_t thread;
+    atomic_bool running;
+} ControlServer;
+
+// names are only ever appended to the engine's table (and
+// to this one), so clients can read [0, n_names) at any
+// time.  get_name only sees a name once get_name_idx has
+// finished writing it
+static void publish_names(ControlServer* s) {
+    ControlHeader* h = s->h;
+    uint32_t n = atomic_load(&h->n_names);
+    char* names = control_names(h);
+
+    while (n < h->max_names) {
+        const char* name = get_name(s->ctx, 0, (int)n);
+        if (!name) {
+            break;
+        }
+
+        char* dst = names + (size_t)n * CONTROL_NAME_LEN;
+        strncpy(dst, name, CONTROL_NAME_LEN - 1);
+        dst[CONTROL_NAME_LEN - 1] = '\0';
+        n++;
+    }
+
+    atomic_store(&h->n_names, n);
+}
+
+static bool to_event(
+        ControlServer* s,
+        const ControlEvent* ce,
+        Event* e) {
+    *e = (Event){
+            .at_count = ce->at_count,
+    };
+
+    switch ((ControlEventType)ce->type) {
+    case CONTROL_WRITE:
+    case CONTROL_WRITE_TIME:
+        if (ce->target_idx < 0 ||
+            (uint32_t)ce->target_idx >=
+                    atomic_load(&s->h->n_names)) {
+            return false;
+        }
+        e->type = ce->type == CONTROL_WRITE
+                          ? EVENT_WRITE
+                          : EVENT_WRITE_TIME;
+        e->target_idx = ce->target_idx;
+        e->value.u = ce->value;
+        return true;
+
+    case CONTROL_RESET_STREAM:
+        e->type = EVENT_RESET_STREAM;
+        e->to_count = ce->value;
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static uint drain(ControlServer* s) {
+    ControlHeader* h = s->h;
+    ControlSlot* slots = control_slots(h);
+    uint64_t mask = h->capacity - 1;
+    uint64_t pos = atomic_load(&h->read_pos);
+
+    uint n = 0;
+    for (;;) {
+        ControlSlot* slot = &slots[pos & mask];
+        uint64_t seq = atomic_load_explicit(
+                &slot->seq, memory_order_acquire);
+        if (seq != pos + 1) {
+            break;
+        }
+
+        ControlEvent ce = slot->event;
+        atomic_store_explicit(
+                &slot->seq,
+                pos + h->capacity,
+                memory_order_release);
+        pos++;
+
+        Event e;
+        // a stream that's gone (or that's too far behind
+        // to take more events) rejects it here
+        if (to_event(s, &ce, &e) &&
+            try_add_event(s->ctx, ce.stream_id, &e)) {
+            n++;
+        } else {
+            atomic_fetch_add(&h->n_rejected, 1);
+        }
+    }
+
+    atomic_store(&h->read_pos, pos);
+    if (n > 0) {
+        atomic_fetch_add(&h->n_applied, n);
+    }
+    return n;
+}
+
+static void* control_thread(void* arg) {
+    ControlServer* s = arg;
+
+    while (atomic_load(&s->running)) {
+        if (drain(s) == 0) {
+            publish_names(s);
+
+            struct timespec ts = {
+                    .tv_sec = 0,
+                    .tv_nsec = 500 * 1000,
+            };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+int control_start(
+        AudioContext* ctx,
+        const char* name,
+        ControlServer** server) {
+    size_t size = control_segment_size(
+            CONTROL_CAPACITY, CONTROL_MAX_NAMES);
+
+    // clear out whatever a previous (crashed) run left
+    // behind
+    shm_unlink(name);
+    int fd =
+            shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0) {
+        perror("control shm_open");
+        return -1;
+    }
+    if (ftruncate(fd, (off_t)size) != 0) {
+        perror("control ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    void* mem = mmap(
+            NULL,
+            size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            fd,
+            0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        perror("control mmap");
+        shm_unlink(name);
+        return -1;
+    }
+
+    ControlHeader* h = mem;
+    h->version = CONTROL_VERSION;
+    h->capacity = CONTROL_CAPACITY;
+    h->max_names = CONTROL_MAX_NAMES;
+    h->sample_rate = (uint32_t)get_sample_rate(ctx);
+    atomic_store(&h->write_pos, 0);
+    atomic_store(&h->read_pos, 0);
+    atomic_store(&h->n_applied, 0);
+    atomic_store(&h->n_rejected, 0);
+    atomic_store(&h->n_names, 0);
+
+    ControlSlot* slots = control_slots(h);
+    for (uint32_t i = 0; i < h->capacity; i++) {
+        atomic_store(&slots[i].seq, i);
+    }
+
+    ControlServer* s = malloc(sizeof(ControlServer));
+    *s = (ControlServer){
+            .ctx = ctx,
+            .shm_name = malloc(strlen(name) + 1),
+            .h = h,
+            .size = size,
+    };
+    strcpy(s->shm_name, name);
+    atomic_store(&s->running, true);
+
+    publish_names(s);
+
+    // clients check this before anything else, so it goes
+    // last
+    atomic_store(&h->magic, CONTROL_MAGIC);
+
+    if (pthread_create(
+                &s->thread, NULL, control_thread, s) != 0) {
+        printf("failed to start control thread\n");
+        atomic_store(&s->running, false);
+        control_stop(s);
+        return -1;
+    }
+
+    *server = s;
+    return 0;
+}
+
+int control_stop(ControlServer* s) {
+    if (atomic_exchange(&s->running, false)) {
+        pthread_join(s->thread, NULL);
+    }
+
+    atomic_store(&s->h->magic, 0);
+    munmap(s->h, s->size);
+    shm_unlink(s->shm_name);
+    free(s->shm_name);
+    free(s);
+
+    return 0;
+}
@@ -22,6 +22,8 @@ double foo(
 int main() {
     AudioContext* ctx = NULL;
     assert(start_audio(&ctx) == 0);
+    int stream_id = create_stream(ctx);
+    assert(stream_id >= 0);
 
     //int event_id = 0;
     Event e;
@@ -36,9 +38,9 @@ int main() {
                     },
             .at_count = 0,
     };
-    add_event(ctx, 0, &e);
+    add_event(ctx, (uint)stream_id, &e);
 
-    stream_play(ctx, 0);
+    stream_play(ctx, (uint)stream_id);
     sleep(100);
 
     assert(stop_audio(ctx) == 0);
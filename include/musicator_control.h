@@ -0,0 +1,223 @@
+#ifndef MUSICATOR_CONTROL_H_IDG
+#define MUSICATOR_CONTROL_H_IDG
+
+// shared-memory control ring, for pushing events into a
+// running engine from other processes without going through
+// midi or the websocket.  the engine creates the segment
+// (see control_start in sound.h), clients map it and push
+// events with plain atomics, so there's no parsing and no
+// syscall per event on either side.
+//
+// the layout only uses fixed-width fields and doesn't
+// depend on sound.h, so anything that agrees on
+// CONTROL_VERSION agrees on the layout.  bump the version
+// on any change.
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CONTROL_MAGIC 0x4c54434dU // "MCTL"
+#define CONTROL_VERSION 1
+#define CONTROL_NAME_LEN 64
+
+typedef enum {
+    CONTROL_WRITE,
+    CONTROL_WRITE_TIME,
+    CONTROL_RESET_STREAM,
+} ControlEventType;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;
+    uint8_t stream_id;
+    uint16_t reserved;
+    // index from the name table (ignored for
+    // CONTROL_RESET_STREAM)
+    int32_t target_idx;
+    // raw Value bits for CONTROL_WRITE, to_count for
+    // CONTROL_RESET_STREAM
+    uint64_t value;
+    // 0 means as soon as possible
+    uint64_t at_count;
+} ControlEvent;
+_Static_assert(sizeof(ControlEvent) == 24, "wire layout");
+
+typedef struct {
+    // slot i is free for the producer at position p when
+    // seq == p, and ready for the consumer when
+    // seq == p + 1
+    _Atomic uint64_t seq;
+    ControlEvent event;
+} ControlSlot;
+_Static_assert(sizeof(ControlSlot) == 32, "wire layout");
+
+typedef struct {
+    _Atomic uint32_t magic;
+    uint32_t version;
+    // power of two
+    uint32_t capacity;
+    uint32_t max_names;
+    uint32_t sample_rate;
+    uint32_t reserved;
+
+    _Alignas(64) _Atomic uint64_t write_pos;
+    _Alignas(64) _Atomic uint64_t read_pos;
+
+    // bumped by the engine, not used by the ring itself
+    _Alignas(64) _Atomic uint64_t n_applied;
+    _Atomic uint64_t n_rejected;
+
+    // names [0, n_names) are valid and never change
+    _Atomic uint32_t n_names;
+} ControlHeader;
+
+static inline char*
+control_names(ControlHeader* h) {
+    return (char*)h + sizeof(ControlHeader);
+}
+
+static inline ControlSlot*
+control_slots(ControlHeader* h) {
+    size_t names_size =
+            (size_t)h->max_names * CONTROL_NAME_LEN;
+    // keep the slots on their own cache lines
+    size_t offset =
+            (sizeof(ControlHeader) + names_size + 63) &
+            ~(size_t)63;
+    return (ControlSlot*)((char*)h + offset);
+}
+
+static inline size_t control_segment_size(
+        uint32_t capacity,
+        uint32_t max_names) {
+    size_t names_size =
+            (size_t)max_names * CONTROL_NAME_LEN;
+    size_t offset =
+            (sizeof(ControlHeader) + names_size + 63) &
+            ~(size_t)63;
+    return offset + (size_t)capacity * sizeof(ControlSlot);
+}
+
+// maps an engine's segment, NULL if it doesn't exist yet or
+// speaks a different version
+static inline ControlHeader* control_client_open(
+        const char* name) {
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        (size_t)st.st_size < sizeof(ControlHeader)) {
+        close(fd);
+        return NULL;
+    }
+
+    void* mem = mmap(
+            NULL,
+            (size_t)st.st_size,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED,
+            fd,
+            0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        return NULL;
+    }
+
+    ControlHeader* h = mem;
+    if (atomic_load(&h->magic) != CONTROL_MAGIC ||
+        h->version != CONTROL_VERSION ||
+        control_segment_size(h->capacity, h->max_names) >
+                (size_t)st.st_size) {
+        munmap(mem, (size_t)st.st_size);
+        return NULL;
+    }
+
+    return h;
+}
+
+static inline void control_client_close(ControlHeader* h) {
+    munmap(h,
+           control_segment_size(h->capacity, h->max_names));
+}
+
+// -1 if the engine hasn't created (or published) the name
+// yet
+static inline int32_t control_find_name(
+        ControlHeader* h,
+        const char* name) {
+    uint32_t n = atomic_load(&h->n_names);
+    const char* names = control_names(h);
+    for (uint32_t i = 0; i < n; i++) {
+        if (strncmp(names + (size_t)i * CONTROL_NAME_LEN,
+                    name,
+                    CONTROL_NAME_LEN) == 0) {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+// safe to call from any number of threads/processes at
+// once.  returns 0 if the ring is full
+static inline int control_push(
+        ControlHeader* h,
+        const ControlEvent* e) {
+    ControlSlot* slots = control_slots(h);
+    uint64_t mask = h->capacity - 1;
+
+    uint64_t pos = atomic_load_explicit(
+            &h->write_pos, memory_order_relaxed);
+    for (;;) {
+        ControlSlot* slot = &slots[pos & mask];
+        uint64_t seq = atomic_load_explicit(
+                &slot->seq, memory_order_acquire);
+
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(
+                        &h->write_pos,
+                        &pos,
+                        pos + 1,
+                        memory_order_relaxed,
+                        memory_order_relaxed)) {
+                slot->event = *e;
+                atomic_store_explicit(
+                        &slot->seq,
+                        pos + 1,
+                        memory_order_release);
+                return 1;
+            }
+        } else if (seq < pos) {
+            return 0;
+        } else {
+            pos = atomic_load_explicit(
+                    &h->write_pos, memory_order_relaxed);
+        }
+    }
+}
+
+static inline int control_push_write(
+        ControlHeader* h,
+        uint8_t stream_id,
+        int32_t target_idx,
+        double value,
+        uint64_t at_count) {
+    ControlEvent e = {
+            .type = CONTROL_WRITE,
+            .stream_id = stream_id,
+            .reserved = 0,
+            .target_idx = target_idx,
+            .value = 0,
+            .at_count = at_count,
+    };
+    memcpy(&e.value, &value, sizeof(value));
+    return control_push(h, &e);
+}
+
+#endif
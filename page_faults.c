@@ -0,0 +1,20 @@
+// RUSAGE_THREAD is only declared with _GNU_SOURCE, which also
+// brings in a uint that conflicts with sound.h's, so this
+// gets a translation unit of its own
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <sys/resource.h>
+
+// page faults the calling thread has taken so far, always
+// 0 where that can't be asked for
+uint64_t thread_page_faults(void) {
+#ifdef RUSAGE_THREAD
+    struct rusage usage;
+    if (getrusage(RUSAGE_THREAD, &usage) == 0) {
+        return (uint64_t)usage.ru_minflt +
+               (uint64_t)usage.ru_majflt;
+    }
+#endif
+    return 0;
+}
@@ -1,13 +1,21 @@
+#define _POSIX_C_SOURCE 200809L
 
 #include "sound.h"
 
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "cubeb/cubeb.h"
 
 #define CHECK(x, v)                                  \
@@ -64,11 +72,162 @@ typedef enum {
     STREAM_PAUSED,
 } StreamState;
 
+// lifetime of an entry in stream_data_buf
+typedef enum {
+    SLOT_FREE,
+    SLOT_INITIALIZING,
+    SLOT_ACTIVE,
+    // waiting for the audio thread to stop touching it
+    SLOT_RELEASING,
+} SlotState;
+
+// TODO make configurable?
+#define MAX_STREAMS 64
+
+// for keeping data written by different threads apart
+#define CACHE_LINE 64
+
+// page faults are only counted in one callback out of this
+// many, since asking costs a syscall either side
+#define PAGE_FAULT_SAMPLE_CALLBACKS 16
+
+// how far ahead the render thread keeps render-ahead
+// streams, and how much it renders at a time
+#define RENDER_AHEAD_SECS 0.3
+#define RENDER_AHEAD_BUF_SECS 0.5
+#define RENDER_AHEAD_CHUNK 256
+
+// TODO make configurable?
+#define FX_MAX_INSERTS 8
+#define FX_MAX_PARAMS 3
+#define FX_MAX_DELAY_SECS 2.0
+// time constant params approach their targets with
+#define FX_SMOOTH_SECS 0.02
+
+// streams with inserts (or pan) are rendered this many
+// frames at a time into their own buffer, before being
+// mixed in
+#define MIX_BUF_FRAMES 1024
+
+// generate_samples converts and mixes in its output this
+// many frames at a time
+#define GENERATE_BLOCK 64
+
+// stream_set_voice_cull defaults, about -80dB
+#define VOICE_CULL_THRESHOLD 1e-4
+#define VOICE_CULL_SECS 0.25
+
+// VALUE_OUT and every VALUE_OUT_CHANNEL
+#define N_OUT_VALUES (VALUE_OUT_CHANNEL + MAX_CHANNELS)
+
+// TODO make configurable?
+// the governor starts shedding voices once a callback takes
+// this much of its deadline, and sheds enough to get
+// (roughly) back down to the target
+#define SHED_LOAD_HIGH 0.75
+#define SHED_LOAD_TARGET 0.5
+// below this share of the callback, voices aren't what's
+// making it slow, and shedding them only thins out the mix
+#define SHED_MIN_VOICE_SHARE 0.25
+// per callback
+#define SHED_MAX_VOICES 8
+// shed voices are faded out over this long, not cut
+#define SHED_FADE_SECS 0.005
+
+// the latency controller doubles the device latency on an
+// xrun (up to LATENCY_MAX_SECS), and halves it again once
+// callbacks have stayed under LATENCY_SHRINK_LOAD of their
+// deadline for LATENCY_SHRINK_SECS
+#define LATENCY_MAX_SECS 0.1
+// a callback overrunning its deadline only means the
+// device might run dry, so overruns count as an xrun once
+// LATENCY_OVERRUNS of them land within
+// LATENCY_OVERRUN_WINDOW_SECS of the first
+#define LATENCY_OVERRUNS 4
+#define LATENCY_OVERRUN_WINDOW_SECS 1.0
+#define LATENCY_SHRINK_LOAD 0.25
+#define LATENCY_SHRINK_SECS 30.0
+// the wait before shrinking doubles every time it has to
+// grow again, so it doesn't keep flapping between two sizes
+#define LATENCY_SHRINK_MAX_SECS 300.0
+// restarting the stream drops out for a moment, so it
+// only shrinks once the output has been below
+// LATENCY_QUIET_LEVEL for this long, where nobody will hear
+// it
+#define LATENCY_QUIET_SECS 0.5
+#define LATENCY_QUIET_LEVEL 1e-4
+
 typedef struct {
-    uint64_t c;
-    // TODO remove?
-    double volume;
+    FxType type;
+
+    // written by fx_set_param, cur approaches it once per
+    // block (on the audio thread)
+    _Atomic(double) target[FX_MAX_PARAMS];
+    double cur[FX_MAX_PARAMS];
+
+    // biquad, transposed direct form II
+    float b0, b1, b2, a1, a2;
+    float z1[MAX_CHANNELS];
+    float z2[MAX_CHANNELS];
+
+    // delay, a ring of frames.  kept around for the next
+    // delay built in this slot to reuse
+    float* delay_buf;
+    uint delay_frames;
+    uint delay_pos;
+} FxInsert;
 
+typedef struct {
+    FxInsert inserts[FX_MAX_INSERTS];
+    // atomic since fx_active and fx_set_param can look at
+    // a bank that's being built
+    atomic_uint_fast32_t n_inserts;
+} FxBank;
+
+struct FxChain {
+    uint sample_rate;
+    uint n_channels;
+    // fx_process runs whichever bank live points to.
+    // fx_set_inserts builds the other one and swaps it in
+    FxBank banks[2];
+    _Atomic(FxBank*) live;
+    // threads inside fx_process.  a bank that's been
+    // swapped out is only built into again once this has
+    // been seen at 0, since then nobody can be running it
+    atomic_uint_fast32_t n_processing;
+};
+
+// per setter slot, alongside setter_buf.  reset whenever a
+// setter is put in the slot
+typedef struct {
+    uint started_at;
+    // consecutive samples below the stream's cull threshold
+    uint quiet_frames;
+    // samples left until a shed voice is gone, 0 if it
+    // isn't being shed
+    uint fade_frames;
+    // loudest output over the last generate_samples call
+    double peak;
+    // seen writing to an output itself, rather than (or as
+    // well as) through its target, see run_setter
+    bool writes_out;
+} VoiceState;
+
+// not padded out to a line each: there are a lot of them
+// per stream, all locked in memory, and producers and the
+// consumer are rarely near each other in the ring anyway
+typedef struct {
+    Event event;
+    _Atomic(EventState) state;
+} EventSlot;
+
+// grouped by who writes what, with the groups that are
+// written all the time on cache lines of their own, so
+// producers (add_event, from any thread) and the consumer
+// (whichever thread renders the stream) don't keep taking
+// lines from each other
+typedef struct {
+    // set up by init_stream_data, only read after that
     struct {
         const char* name;
         int id;
@@ -76,29 +235,176 @@ typedef struct {
 
     ValueSetter* setter_buf;
     uint setter_buf_size;
+    VoiceState* voice_buf;
 
     Value* value_buf;
     ValueState* value_state_buf;
-    char** value_name_buf;
+    // written by get_name_idx's thread, but read by the
+    // control thread too (see get_name), so a name is only
+    // published once it's filled in
+    char* _Atomic* value_name_buf;
     uint value_buf_size;
 
-    Event* event_buf;
-    _Atomic(EventState) * event_state_buf;
+    EventSlot* event_buf;
     uint event_buf_size;
-    uint event_pos;
-    atomic_uint_fast32_t event_reserved_pos;
 
+    // backing storage for EVENT_WRITE_BATCH.  positions are
+    // monotonic (taken mod batch_buf_size), and batches are
+    // always contiguous in the buffer
+    BatchWrite* batch_buf;
+    uint batch_buf_size;
+
+    float* mix_buf;
+
+    // TODO remove?
+    double volume;
+
+    // set from the controlling thread, once in a while
     _Atomic(StreamState) stream_state;
+    _Atomic(SlotState) slot_state;
+
+    // muted (or not soloed while something else is) streams
+    // still process events and keep time, but never run
+    // their setters
+    atomic_bool muted;
+    atomic_bool solo;
+    // never silenced by other streams' solo, see
+    // stream_set_solo_safe
+    atomic_bool solo_safe;
+
+    // see stream_set_voice_cull, cull_frames 0 is off
+    _Atomic(double) cull_threshold;
+    atomic_uint_fast64_t cull_frames;
+    atomic_int priority;
+
+    _Atomic(double) pan;
+
+    // render-ahead streams are rendered by render_thread
+    // into ahead_buf (a ring of frames), and data_cb only
+    // copies out of it.  render_lock (further down) is held
+    // by whoever is modifying the stream's state outside of
+    // the audio thread (the render thread while rendering,
+    // scrub/clear while invalidating).  the render thread
+    // only renders playing streams, and leaves edited ones
+    // alone entirely, see stream_begin_edit
+    atomic_bool render_ahead;
+    atomic_bool editing;
+    float* ahead_buf;
+    uint ahead_buf_frames;
+
+    // frozen streams play back this pre-rendered audio
+    // (indexed by c) instead of running setters
+    _Atomic(const float*) frozen_pcm;
+    uint frozen_frames;
+
+    // producers
+    _Alignas(CACHE_LINE) atomic_uint_fast32_t
+            event_reserved_pos;
+    // threads inside try_add_event.  create_stream waits
+    // for this to reach 0 before reinitializing the slot
+    atomic_uint_fast32_t n_adding;
+    // only for ordering batch producers, so that arena
+    // order always matches event order
+    atomic_flag batch_lock;
+    atomic_uint_fast64_t batch_reserved_pos;
+
+    // consumer
+    _Alignas(CACHE_LINE) uint64_t c;
+    uint event_pos;
+    // number of non-empty entries in setter_buf
+    uint n_active_setters;
+    atomic_uint_fast64_t batch_released_pos;
+
+    // copy of c for other threads, updated once per
+    // callback
+    atomic_uint_fast64_t published_c;
+
+    atomic_uint_fast64_t n_events_processed;
+    atomic_uint_fast64_t n_voices_culled;
+
+    // audio thread's copy, which follows pan once per block
+    double pan_cur;
+
+    // render thread.  taking and releasing render_lock for
+    // every chunk writes to it, so it's kept off the lines
+    // data_cb reads every callback
+    _Alignas(CACHE_LINE) pthread_mutex_t render_lock;
+    // monotonic frame positions in ahead_buf, written by
+    // the render thread and the audio thread respectively
+    atomic_uint_fast64_t ahead_write_pos;
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t
+            ahead_read_pos;
+
+    _Alignas(CACHE_LINE) FxChain fx;
 } StreamData;
 
 typedef struct AudioContext {
+    // always MAX_STREAMS long, see slot_state
     StreamData* stream_data_buf;
     uint stream_data_buf_size;
+    // number of streams with solo set
+    atomic_uint_fast32_t n_solo;
 
     uint sample_rate;
-
+    // see get_latency_frames.  only changed by the render
+    // thread, while the stream is stopped
+    atomic_uint_fast64_t latency_frames;
+    uint min_latency_frames;
+    uint max_latency_frames;
+    // what data_cb would like latency_frames to be, 0 when
+    // it's happy with it
+    atomic_uint_fast64_t latency_request;
+    atomic_uint_fast64_t n_latency_changes;
+    uint n_channels;
+
+    // both NULL when running headless
     cubeb_stream* stream;
     cubeb* ctx;
+    // kept for reopening the stream at a different latency
+    cubeb_stream_params output_params;
+
+    // not started for headless contexts, render-ahead
+    // streams are rendered inline there
+    pthread_t render_thread;
+    atomic_bool render_thread_running;
+    float* render_chunk_buf;
+
+    // only written by whichever thread runs data_cb
+    _Alignas(CACHE_LINE) atomic_uint_fast64_t
+            n_ahead_underruns;
+    atomic_uint_fast64_t n_callbacks;
+    atomic_uint_fast64_t n_frames;
+    atomic_uint_fast64_t callback_ns_total;
+    atomic_uint_fast64_t callback_ns_max;
+    atomic_uint_fast64_t n_voices_shed;
+    atomic_uint_fast64_t n_callback_page_faults;
+    atomic_uint_fast64_t n_xruns;
+    atomic_uint_fast64_t n_overruns;
+
+    // frames until the governor next looks at the load, so
+    // voices it's fading out get a chance to go first
+    uint shed_holdoff;
+    // time this callback spent running setters for voices
+    // the governor could shed
+    uint64_t voices_ns;
+
+    // latency controller state, see control_latency
+    uint headroom_frames;
+    uint shrink_after_frames;
+    uint quiet_frames;
+    uint seen_xruns;
+    // overruns since the first one still in the window,
+    // and frames since that one
+    uint recent_overruns;
+    uint overrun_window_frames;
+
+    // render thread's, see check_xruns.  n_frames when the
+    // current stream was opened, and the furthest the
+    // device has played past what it was given
+    uint stream_start_frames;
+    uint position_lead;
+
+    _Alignas(CACHE_LINE) FxChain master_fx;
 } AudioContext;
 
 // TODO is this unstable?
@@ -116,6 +422,29 @@ uint get_sample_count(AudioContext* ctx, double time) {
     return (uint)round((double)(ctx->sample_rate) * time);
 }
 
+uint get_stream_count(AudioContext* ctx, uint stream_id) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    return atomic_load(&p->published_c);
+}
+
+uint get_latency_frames(AudioContext* ctx) {
+    return atomic_load(&ctx->latency_frames);
+}
+
+uint get_sample_rate(AudioContext* ctx) {
+    return ctx->sample_rate;
+}
+
+uint get_channel_count(AudioContext* ctx) {
+    return ctx->n_channels;
+}
+
+bool valid_stream(AudioContext* ctx, uint stream_id) {
+    return stream_id < ctx->stream_data_buf_size &&
+           atomic_load(&ctx->stream_data_buf[stream_id]
+                                .slot_state) == SLOT_ACTIVE;
+}
+
 // TODO control lock to make these thread safe?
 void add_event(
         AudioContext* ctx,
@@ -130,25 +459,173 @@ void add_event(
     // TODO figure out what to actually do here, for
     // scrubbing purposes wrapping isn't really what we want
     // assert(event_idx != p->event_buf_size - 1);
-    p->event_buf[event_idx] = *e;
+    p->event_buf[event_idx].event = *e;
 
     EventState old_state = atomic_exchange(
-            &p->event_state_buf[event_idx],
+            &p->event_buf[event_idx].state,
             EVENT_STATE_READY);
     assert(old_state != EVENT_STATE_READY);
 }
 
+// reserves the next event slot, unless it still holds an
+// event that hasn't been processed (processed ones are only
+// kept around for scrubbing)
+static bool reserve_event(
+        StreamData* p,
+        uint_fast32_t* event_idx) {
+    uint_fast32_t idx = atomic_load(&p->event_reserved_pos);
+    do {
+        if (atomic_load(&p->event_buf[idx].state) ==
+            EVENT_STATE_READY) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(
+            &p->event_reserved_pos,
+            &idx,
+            (idx + 1) % p->event_buf_size));
+
+    *event_idx = idx;
+    return true;
+}
+
+bool try_add_event(
+        AudioContext* ctx,
+        uint stream_id,
+        const Event* e) {
+    if (stream_id >= ctx->stream_data_buf_size) {
+        return false;
+    }
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+
+    // the slot can't be recycled while this is held, so
+    // it's still the stream that was checked that gets the
+    // event
+    atomic_fetch_add(&p->n_adding, 1);
+
+    uint_fast32_t event_idx;
+    bool added =
+            atomic_load(&p->slot_state) == SLOT_ACTIVE &&
+            reserve_event(p, &event_idx);
+    if (added) {
+        p->event_buf[event_idx].event = *e;
+        atomic_store(
+                &p->event_buf[event_idx].state,
+                EVENT_STATE_READY);
+    }
+
+    atomic_fetch_sub(&p->n_adding, 1);
+    return added;
+}
+
+// reserves n contiguous entries in the batch arena,
+// returning (uint)-1 if that would clobber unprocessed
+// batches
+static uint reserve_batch(
+        StreamData* p,
+        uint n,
+        uint* end) {
+    uint size = p->batch_buf_size;
+    if (n > size) {
+        return (uint)-1;
+    }
+
+    uint start = atomic_load(&p->batch_reserved_pos);
+    uint offset = start % size;
+    if (offset + n > size) {
+        // don't split across the end, skip to the start
+        start += size - offset;
+        offset = 0;
+    }
+
+    if (start + n - atomic_load(&p->batch_released_pos) >
+        size) {
+        return (uint)-1;
+    }
+
+    *end = start + n;
+    atomic_store(&p->batch_reserved_pos, *end);
+    // the reservation has to be visible before anything is
+    // written into it, see batch_intact
+    atomic_thread_fence(memory_order_release);
+    return offset;
+}
+
+void add_write_batch(
+        AudioContext* ctx,
+        uint stream_id,
+        const BatchWrite* writes,
+        uint n_writes,
+        uint at_count) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+
+    while (atomic_flag_test_and_set(&p->batch_lock)) {
+    }
+
+    uint end;
+    uint offset = reserve_batch(p, n_writes, &end);
+    if (offset != (uint)-1) {
+        BatchWrite* arena_writes = &p->batch_buf[offset];
+        memcpy(arena_writes,
+               writes,
+               sizeof(BatchWrite) * n_writes);
+
+        Event e = {
+                .type = EVENT_WRITE_BATCH,
+                .batch =
+                        {
+                                .writes = arena_writes,
+                                .n_writes = n_writes,
+                                .arena_end = end,
+                        },
+                .at_count = at_count,
+        };
+        add_event(ctx, stream_id, &e);
+        atomic_flag_clear(&p->batch_lock);
+        return;
+    }
+    atomic_flag_clear(&p->batch_lock);
+
+    printf("batch arena full, splitting %lu writes\n",
+           n_writes);
+    for (uint i = 0; i < n_writes; i++) {
+        Event e = {
+                .type = writes[i].type == BATCH_WRITE_TIME
+                                ? EVENT_WRITE_TIME
+                                : EVENT_WRITE,
+                .target_idx = writes[i].target_idx,
+                .value = writes[i].value,
+                .at_count = at_count,
+        };
+        add_event(ctx, stream_id, &e);
+    }
+}
+
+// drops everything rendered ahead.  only valid while paused
+// (so data_cb isn't reading) and with render_lock held (so
+// the render thread isn't writing)
+static void reset_render_ahead(StreamData* p) {
+    atomic_store(
+            &p->ahead_write_pos,
+            atomic_load(&p->ahead_read_pos));
+}
+
 void clear_events(AudioContext* ctx, uint stream_id) {
     StreamData* p = &(ctx->stream_data_buf[stream_id]);
     StreamState s = atomic_load(&p->stream_state);
     switch (s) {
     case STREAM_PAUSED:
+        pthread_mutex_lock(&p->render_lock);
         for (uint i = 0; i < p->event_buf_size; i++) {
             atomic_store(
-                    &p->event_state_buf[i],
+                    &p->event_buf[i].state,
                     EVENT_STATE_UNINITIALIZED);
         }
+        p->event_pos = 0;
         atomic_store(&p->event_reserved_pos, 0);
+        atomic_store(&p->batch_reserved_pos, 0);
+        atomic_store(&p->batch_released_pos, 0);
+        reset_render_ahead(p);
+        pthread_mutex_unlock(&p->render_lock);
         return;
 
     case STREAM_PLAYING:
@@ -159,9 +636,9 @@ void clear_events(AudioContext* ctx, uint stream_id) {
     }
 }
 
-// TODO this particularly super unthreadsafe, but that's
-// fine for now as long as the stream thread never touches
-// names
+// only one thread may add names to a stream at a time (the
+// frontend holds its state lock).  the stream thread never
+// touches them
 int get_name_idx(
         AudioContext* ctx,
         uint stream_id,
@@ -169,17 +646,23 @@ int get_name_idx(
     StreamData* p = &(ctx->stream_data_buf[stream_id]);
 
     for (int i = 0; i < (int)p->value_buf_size; i++) {
-        if (p->value_name_buf[i] &&
-            strcmp(p->value_name_buf[i], name) == 0) {
+        const char* n = atomic_load_explicit(
+                &p->value_name_buf[i],
+                memory_order_acquire);
+        if (n && strcmp(n, name) == 0) {
             return i;
         }
     }
 
     for (int i = 0; i < (int)p->value_buf_size; i++) {
-        if (!p->value_name_buf[i]) {
+        if (!atomic_load(&p->value_name_buf[i])) {
             size_t l = strlen(name);
-            p->value_name_buf[i] = malloc(l + 1);
-            strcpy(p->value_name_buf[i], name);
+            char* n = malloc(l + 1);
+            strcpy(n, name);
+            atomic_store_explicit(
+                    &p->value_name_buf[i],
+                    n,
+                    memory_order_release);
             return i;
         }
     }
@@ -189,9 +672,33 @@ int get_name_idx(
     return -1;
 }
 
+const char* get_name(
+        AudioContext* ctx,
+        uint stream_id,
+        int idx) {
+    if (!valid_stream(ctx, stream_id)) {
+        return NULL;
+    }
+
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+
+    if (idx < 0 || (uint)idx >= p->value_buf_size) {
+        return NULL;
+    }
+    return atomic_load_explicit(
+            &p->value_name_buf[idx],
+            memory_order_acquire);
+}
+
+static void prime_render_ahead(
+        AudioContext* ctx,
+        StreamData* p);
+
 void stream_play(AudioContext* ctx, uint stream_id) {
     StreamData* p = &(ctx->stream_data_buf[stream_id]);
 
+    prime_render_ahead(ctx, p);
+
     for (;;) {
         StreamState s = atomic_load(&p->stream_state);
 
@@ -245,14 +752,31 @@ void stream_pause(AudioContext* ctx, uint stream_id) {
     }
 }
 
+void stream_begin_edit(AudioContext* ctx, uint stream_id) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    assert(atomic_load(&p->stream_state) == STREAM_PAUSED);
+
+    // the render thread checks editing with the lock held,
+    // so once we've had it, it's done with the stream
+    pthread_mutex_lock(&p->render_lock);
+    atomic_store(&p->editing, true);
+    pthread_mutex_unlock(&p->render_lock);
+}
+
+void stream_end_edit(AudioContext* ctx, uint stream_id) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    atomic_store(&p->editing, false);
+}
+
 static void jump_stream(StreamData* p, uint to_count) {
     p->c = to_count;
+    atomic_store(&p->published_c, to_count);
     for (;;) {
         uint prev_event_pos =
                 (p->event_pos + (p->event_buf_size - 1)) %
                 p->event_buf_size;
         EventState event_state = atomic_load(
-                &p->event_state_buf[prev_event_pos]);
+                &p->event_buf[prev_event_pos].state);
         if (event_state == EVENT_STATE_UNINITIALIZED) {
             return;
         }
@@ -261,14 +785,14 @@ static void jump_stream(StreamData* p, uint to_count) {
         // later
         assert(event_state == EVENT_STATE_PROCESSED);
 
-        Event* e = &p->event_buf[prev_event_pos];
+        Event* e = &p->event_buf[prev_event_pos].event;
 
         if (e->at_count < to_count) {
             return;
         }
 
         bool cas_succeed = atomic_compare_exchange_strong(
-                &p->event_state_buf[prev_event_pos],
+                &p->event_buf[prev_event_pos].state,
                 &event_state,
                 EVENT_STATE_READY);
         if (!cas_succeed) {
@@ -290,7 +814,10 @@ void stream_scrub(
     StreamState s = atomic_load(&p->stream_state);
     switch (s) {
     case STREAM_PAUSED:
+        pthread_mutex_lock(&p->render_lock);
         jump_stream(p, to_count);
+        reset_render_ahead(p);
+        pthread_mutex_unlock(&p->render_lock);
         return;
 
     case STREAM_PLAYING:
@@ -311,7 +838,7 @@ static void dump_events(StreamData* p) {
             printf("event pos at %lu\n", i);
         }
 
-        EventState s = atomic_load(&p->event_state_buf[i]);
+        EventState s = atomic_load(&p->event_buf[i].state);
 
         if (s == EVENT_STATE_UNINITIALIZED) {
             consecutive_uninitialized++;
@@ -337,7 +864,7 @@ static void dump_events(StreamData* p) {
             break;
         }
 
-        Event e = p->event_buf[i];
+        Event e = p->event_buf[i].event;
         printf("type: ");
         switch (e.type) {
         case EVENT_SETTER:
@@ -353,12 +880,45 @@ static void dump_events(StreamData* p) {
         case EVENT_RESET_STREAM:
             printf("EVENT_RESET_STREAM\n");
             break;
+        case EVENT_WRITE_RANGE:
+            printf("EVENT_WRITE_RANGE\n");
+            printf("%d + %lu\n", e.target_idx, e.range_len);
+            break;
+        case EVENT_WRITE_BATCH:
+            printf("EVENT_WRITE_BATCH\n");
+            printf("%lu writes\n", e.batch.n_writes);
+            break;
+        case EVENT_FX_PARAM:
+            printf("EVENT_FX_PARAM\n");
+            printf("%d.%d = %f\n",
+                   e.fx.slot,
+                   e.fx.param,
+                   e.fx.value);
+            break;
         }
 
         printf("at_count: %lu\n", e.at_count);
     }
 }
 
+// whether a batch that was reserved at [start, ...) is
+// still in the arena.  a rewind (scrub or
+// EVENT_RESET_STREAM) can replay a batch long after it was
+// released, by which point newer batches may have been
+// written over it
+static bool batch_intact(StreamData* p, uint start) {
+    return atomic_load(&p->batch_reserved_pos) <=
+           start + p->batch_buf_size;
+}
+
+// positions only ever move forward, replayed batches
+// shouldn't hand back space that's already in use again
+static void release_batch(StreamData* p, uint arena_end) {
+    if (arena_end > atomic_load(&p->batch_released_pos)) {
+        atomic_store(&p->batch_released_pos, arena_end);
+    }
+}
+
 static uint process_events(StreamData* p, uint64_t n) {
     uint next_n;
     uint64_t end = p->c + n;
@@ -367,12 +927,12 @@ static uint process_events(StreamData* p, uint64_t n) {
 
     for (;;) {
         if (atomic_load(
-                    &p->event_state_buf[p->event_pos]) !=
+                    &p->event_buf[p->event_pos].state) !=
             EVENT_STATE_READY) {
             return n;
         }
 
-        Event* e = &p->event_buf[p->event_pos];
+        Event* e = &p->event_buf[p->event_pos].event;
         if (e->at_count < p->c) {
             // event "in the past" (process it now, and
             // retroactively update its timestamp)
@@ -391,8 +951,6 @@ static uint process_events(StreamData* p, uint64_t n) {
             return next_n;
         }
 
-        printf("processing event %lu\n", p->event_pos);
-
         switch (e->type) {
         case EVENT_SETTER: {
             uint setter_buf_idx = (uint)-1;
@@ -416,7 +974,14 @@ static uint process_events(StreamData* p, uint64_t n) {
             // TODO handle out-of-space
             assert(setter_buf_idx != (uint)-1);
 
+            ValueSetter* prev =
+                    &p->setter_buf[setter_buf_idx];
+            p->n_active_setters -= prev->fn != NULL;
+            p->n_active_setters += e->setter.fn != NULL;
             p->setter_buf[setter_buf_idx] = e->setter;
+            p->voice_buf[setter_buf_idx] = (VoiceState){
+                    .started_at = p->c,
+            };
             assert(e->setter.target_idx >= 0 &&
                    (uint)(e->setter.target_idx) <
                            p->value_buf_size);
@@ -444,6 +1009,63 @@ static uint process_events(StreamData* p, uint64_t n) {
             break;
         }
 
+        case EVENT_WRITE_RANGE: {
+            assert(e->target_idx >= 0 &&
+                   (uint)(e->target_idx) + e->range_len <=
+                           p->value_buf_size);
+            for (uint i = 0; i < e->range_len; i++) {
+                uint idx = (uint)e->target_idx + i;
+                p->value_state_buf[idx] = VALUE_KEEP;
+                p->value_buf[idx] = e->value;
+            }
+            break;
+        }
+
+        case EVENT_WRITE_BATCH: {
+            uint start =
+                    e->batch.arena_end - e->batch.n_writes;
+            for (uint i = 0; i < e->batch.n_writes; i++) {
+                // copied out and checked afterwards, since
+                // a producer may be writing over it right
+                // now if it's stale.  a stale batch is
+                // dropped (from there on), there's nothing
+                // better to replay
+                BatchWrite w = e->batch.writes[i];
+                atomic_thread_fence(memory_order_acquire);
+                if (!batch_intact(p, start)) {
+                    break;
+                }
+
+                assert(w.target_idx >= 0 &&
+                       (uint)(w.target_idx) <
+                               p->value_buf_size);
+                p->value_state_buf[w.target_idx] =
+                        VALUE_KEEP;
+                if (w.type == BATCH_WRITE_TIME) {
+                    p->value_buf[w.target_idx].u = p->c;
+                } else {
+                    p->value_buf[w.target_idx] = w.value;
+                }
+            }
+
+            release_batch(p, e->batch.arena_end);
+            break;
+        }
+
+        case EVENT_FX_PARAM: {
+            // the clones render_offline_parallel works on
+            // have no chain (see alloc_stream_clone).  it
+            // applies these to the real stream at the end
+            if (atomic_load(&p->fx.live)) {
+                fx_set_param(
+                        &p->fx,
+                        e->fx.slot,
+                        e->fx.param,
+                        e->fx.value);
+            }
+            break;
+        }
+
         case EVENT_RESET_STREAM: {
             // TODO add some sort of conditional
             // functionality here, to prevent every scrub
@@ -461,19 +1083,131 @@ static uint process_events(StreamData* p, uint64_t n) {
             assert(0);
         }
         atomic_store(
-                &p->event_state_buf[p->event_pos],
+                &p->event_buf[p->event_pos].state,
                 EVENT_STATE_PROCESSED);
+        atomic_fetch_add_explicit(
+                &p->n_events_processed,
+                1,
+                memory_order_relaxed);
 
         p->event_pos =
                 (p->event_pos + 1) % p->event_buf_size;
     }
 }
 
+// out[i] += in[i] for n floats
+static void mix_block(float* out, const float* in, uint n) {
+    uint i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= n; i += 4) {
+        __m128 o = _mm_loadu_ps(out + i);
+        __m128 x = _mm_loadu_ps(in + i);
+        _mm_storeu_ps(out + i, _mm_add_ps(o, x));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] += in[i];
+    }
+}
+
+// out[i] += (float)in[i] for n values
+static void mix_doubles(
+        float* out,
+        const double* in,
+        uint n) {
+    uint i = 0;
+#ifdef __SSE2__
+    for (; i + 4 <= n; i += 4) {
+        __m128 lo = _mm_cvtpd_ps(_mm_loadu_pd(in + i));
+        __m128 hi = _mm_cvtpd_ps(_mm_loadu_pd(in + i + 2));
+        __m128 o = _mm_loadu_ps(out + i);
+        __m128 v = _mm_movelh_ps(lo, hi);
+        _mm_storeu_ps(out + i, _mm_add_ps(o, v));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] += (float)in[i];
+    }
+}
+
+// whether a setter writing to idx is heard directly
+static bool is_out_value(int idx) {
+    return idx >= VALUE_OUT && idx < N_OUT_VALUES;
+}
+
+// whether setter slot i is heard, and so something voice
+// culling and shedding should look at.  the rest only feed
+// other setters
+static bool is_voice(StreamData* p, uint i) {
+    return is_out_value(p->setter_buf[i].target_idx) ||
+           p->voice_buf[i].writes_out;
+}
+
+// runs setter slot i for one frame, with everything it adds
+// to the first n_outs values (the outputs) scaled by gain.
+// returns how loud it was before that: the most it added to
+// any output, through its target or by writing the outputs
+// itself (like main.d's out_channel)
+static double run_setter(
+        StreamData* p,
+        uint i,
+        const ValueInput* value_input,
+        uint n_outs,
+        double gain,
+        bool* expire) {
+    ValueSetter* setter = &p->setter_buf[i];
+    Value* values = p->value_buf;
+
+    double before[N_OUT_VALUES];
+    for (uint k = 0; k < n_outs; k++) {
+        before[k] = values[k].d;
+    }
+
+    double v = setter->fn(
+            value_input, setter->local_idxs, expire);
+
+    double level = 0;
+    for (uint k = 0; k < n_outs; k++) {
+        double d = values[k].d - before[k];
+        if (gain != 1) {
+            values[k].d = before[k] + d * gain;
+        }
+        level = fabs(d) > level ? fabs(d) : level;
+    }
+    if (level > 0) {
+        p->voice_buf[i].writes_out = true;
+    }
+
+    // TODO non-floating setter targets?
+    if (gain != 0) {
+        values[setter->target_idx].d += v * gain;
+    }
+    if (is_out_value(setter->target_idx) &&
+        fabs(v) > level) {
+        level = fabs(v);
+    }
+    return level;
+}
+
+// the output values of the frame just computed, one per
+// channel
+static void collect_frame(
+        StreamData* p,
+        double* frame,
+        uint n_channels) {
+    double r = p->value_buf[VALUE_OUT].d;
+    for (uint c = 0; c < n_channels; c++) {
+        double rc = p->value_buf[VALUE_OUT_CHANNEL + c].d;
+        frame[c] = (r + rc) * p->volume;
+    }
+}
+
 static void generate_samples(
         StreamData* p,
         float* out,
         uint64_t n,
-        uint sample_rate) {
+        uint sample_rate,
+        uint n_channels) {
     uint n_generated = 0;
 
     ValueInput value_input = (ValueInput){
@@ -482,15 +1216,39 @@ static void generate_samples(
             .values = p->value_buf,
     };
 
+    // frames are collected here and converted into out a
+    // block at a time
+    double block[GENERATE_BLOCK * MAX_CHANNELS];
+
+    double cull_threshold = atomic_load(&p->cull_threshold);
+    uint cull_frames = atomic_load(&p->cull_frames);
+    double fade_len =
+            round(SHED_FADE_SECS * (double)sample_rate);
+    uint n_culled = 0;
+
+    for (uint i = 0; i < p->setter_buf_size; i++) {
+        p->voice_buf[i].peak = 0;
+    }
+
     for (;;) {
         // num samples to calculate until processing next
         // event
         uint64_t next_n =
                 process_events(p, n - n_generated);
 
+        // nothing can write to out until the next event, so
+        // there's nothing to do but keep time
+        ValueState* states = p->value_state_buf;
+        bool idle = p->n_active_setters == 0 &&
+                    states[VALUE_OUT] == VALUE_RESET;
+        for (uint c = 0; c < n_channels; c++) {
+            idle = idle && states[VALUE_OUT_CHANNEL + c] ==
+                                   VALUE_RESET;
+        }
+
         // TODO it'd probably be faster to invert these
         // loops
-        for (uint i = 0; i < next_n; i++) {
+        for (uint i = 0; i < (idle ? 0 : next_n); i++) {
             // TODO if i want to support a large number of
             // values, this needs to be done differently
             for (uint j = 0; j < p->value_buf_size; j++) {
@@ -507,35 +1265,63 @@ static void generate_samples(
                  setter_idx < p->setter_buf_size;
                  setter_idx++) {
                 if (p->setter_buf[setter_idx].fn) {
-                    // TODO non-floating setter targets?
-                    double* target =
-                            &p->value_buf
-                                     [p->setter_buf[setter_idx]
-                                              .target_idx]
-                                             .d;
-                    *target += p->setter_buf[setter_idx].fn(
+                    VoiceState* voice =
+                            &p->voice_buf[setter_idx];
+
+                    double gain = 1;
+                    if (voice->fade_frames > 0) {
+                        gain = (double)voice->fade_frames /
+                               fade_len;
+                    }
+                    double a = run_setter(
+                            p,
+                            setter_idx,
                             &value_input,
-                            p->setter_buf[setter_idx]
-                                    .local_idxs,
+                            VALUE_OUT_CHANNEL + n_channels,
+                            gain,
                             &expire);
 
+                    if (voice->fade_frames > 0) {
+                        voice->fade_frames--;
+                        expire = expire ||
+                                 voice->fade_frames == 0;
+                    }
+
+                    if (is_voice(p, setter_idx)) {
+                        if (a > voice->peak) {
+                            voice->peak = a;
+                        }
+                        if (a >= cull_threshold) {
+                            voice->quiet_frames = 0;
+                        } else if (++voice->quiet_frames >=
+                                           cull_frames &&
+                                   cull_frames > 0 &&
+                                   !expire) {
+                            expire = true;
+                            n_culled++;
+                        }
+                    }
+
                     if (expire) {
                         p->setter_buf[setter_idx] =
                                 EMPTY_SETTER;
+                        p->n_active_setters--;
                         expire = false;
                     }
                 }
             }
 
-            // TODO don't hardcode "special" value_buf idxs,
-            // throw them in an enum or something
-            double r = p->value_buf[0].d;
-            r *= p->volume;
-
-            // TODO stereo
             // TODO use integer samples instead of float?
-            for (uint c = 0; c < 2; c++) {
-                out[2 * i + c] += (float)r;
+            uint k = i % GENERATE_BLOCK;
+            collect_frame(
+                    p, block + k * n_channels, n_channels);
+            if (k == GENERATE_BLOCK - 1 ||
+                i == next_n - 1) {
+                uint from = i - k;
+                mix_doubles(
+                        out + from * n_channels,
+                        block,
+                        (k + 1) * n_channels);
             }
 
             value_input.t++;
@@ -543,174 +1329,2347 @@ static void generate_samples(
 
         n_generated += next_n;
         p->c += next_n;
-        out += 2 * next_n;
+        value_input.t = p->c;
+        out += n_channels * next_n;
 
         if (n_generated == n) {
             break;
         }
         assert(n_generated < n);
     }
+
+    atomic_store(&p->published_c, p->c);
+    if (n_culled > 0) {
+        atomic_fetch_add_explicit(
+                &p->n_voices_culled,
+                n_culled,
+                memory_order_relaxed);
+    }
 }
 
-static long data_cb(
-        cubeb_stream* stm,
-        void* user,
-        const void* in_s,
-        void* out_s,
-        long n_signed) {
-    (void)stm;
-    (void)in_s;
+// like generate_samples, but only processes events
+static void skip_samples(StreamData* p, uint64_t n) {
+    uint n_skipped = 0;
+    while (n_skipped < n) {
+        uint64_t next_n = process_events(p, n - n_skipped);
+        n_skipped += next_n;
+        p->c += next_n;
+    }
 
-    AudioContext* ctx = user;
+    atomic_store(&p->published_c, p->c);
+}
 
-    float* out = out_s;
-    uint64_t n = (uint64_t)n_signed;
+static void read_frozen(
+        StreamData* p,
+        const float* pcm,
+        float* out,
+        uint64_t n,
+        uint n_channels,
+        bool audible) {
+    if (audible && p->c < p->frozen_frames) {
+        uint m = p->frozen_frames - p->c;
+        m = n < m ? n : m;
+        mix_block(
+                out,
+                pcm + p->c * n_channels,
+                m * n_channels);
+    }
 
-    for (uint i = 0; i < n; i++) {
-        for (uint c = 0; c < 2; c++) {
-            out[2 * i + c] = 0;
-        }
+    // events still get processed, so unfreezing picks up in
+    // a consistent state
+    skip_samples(p, n);
+}
+
+// mixes n frames of a render-ahead stream into out (or just
+// drops them, if it isn't audible)
+static void read_ahead(
+        AudioContext* ctx,
+        StreamData* p,
+        float* out,
+        uint64_t n,
+        bool audible) {
+    uint read_pos = atomic_load(&p->ahead_read_pos);
+    uint write_pos = atomic_load(&p->ahead_write_pos);
+    // the write position trails behind after an underrun,
+    // until the render thread catches up
+    uint available =
+            write_pos > read_pos ? write_pos - read_pos : 0;
+
+    uint m = n < available ? n : available;
+    if (m < n) {
+        // the rest is silence.  the read position still
+        // moves on by all of n, and the render thread skips
+        // the stream ahead to match, so it stays in time
+        // with the others
+        atomic_fetch_add_explicit(
+                &ctx->n_ahead_underruns,
+                1,
+                memory_order_relaxed);
     }
 
-    for (uint i = 0; i < ctx->stream_data_buf_size; i++) {
-        StreamData* p = &(ctx->stream_data_buf[i]);
-        StreamState stream_state =
-                atomic_load(&p->stream_state);
+    // in up to two spans, around the end of the ring
+    uint nch = ctx->n_channels;
+    for (uint done = 0; audible && done < m;) {
+        uint frame =
+                (read_pos + done) % p->ahead_buf_frames;
+        uint span = p->ahead_buf_frames - frame;
+        span = m - done < span ? m - done : span;
+        mix_block(
+                out + done * nch,
+                p->ahead_buf + frame * nch,
+                span * nch);
+        done += span;
+    }
 
-        switch (stream_state) {
-        case STREAM_PLAYING:
-            generate_samples(p, out, n, ctx->sample_rate);
-            break;
+    atomic_store(&p->ahead_read_pos, read_pos + n);
+}
 
-        case STREAM_PAUSE_NEXT_SAMPLE: {
-            bool r = atomic_compare_exchange_strong(
-                    &p->stream_state,
-                    &stream_state,
-                    STREAM_PAUSED);
-            if (!r) {
-                printf("failed to pause in data_cb?  state changed to %d",
-                       stream_state);
-            }
+// per-channel gains, ramping linearly from g0 to g1 over
+// the block
+static void gain_ramp_block(
+        float* buf,
+        uint n_frames,
+        uint n_channels,
+        const float* g0,
+        const float* g1) {
+    float step[MAX_CHANNELS];
+    for (uint ch = 0; ch < n_channels; ch++) {
+        step[ch] = (g1[ch] - g0[ch]) / (float)n_frames;
+    }
+
+    uint i = 0;
+#ifdef __SSE2__
+    // each vector covers 4 / n_channels whole frames
+    if (4 % n_channels == 0) {
+        uint frames_per_vec = 4 / n_channels;
+        float g[4];
+        float d[4];
+        for (uint j = 0; j < 4; j++) {
+            uint ch = j % n_channels;
+            float frame = (float)(j / n_channels);
+            g[j] = g0[ch] + step[ch] * frame;
+            d[j] = step[ch] * (float)frames_per_vec;
         }
-        case STREAM_PAUSED:
-            break;
+        __m128 gv = _mm_loadu_ps(g);
+        __m128 dv = _mm_loadu_ps(d);
+
+        uint n = n_frames * n_channels;
+        for (; i + 4 <= n; i += 4) {
+            __m128 x = _mm_loadu_ps(buf + i);
+            _mm_storeu_ps(buf + i, _mm_mul_ps(x, gv));
+            gv = _mm_add_ps(gv, dv);
+        }
+    }
+#endif
+    for (; i < n_frames * n_channels; i++) {
+        uint ch = i % n_channels;
+        float frame = (float)(i / n_channels);
+        buf[i] *= g0[ch] + step[ch] * frame;
+    }
+}
 
-        default:
-            assert(0);
+static void biquad_block(
+        FxInsert* fx,
+        float* buf,
+        uint n_frames,
+        uint n_channels) {
+    uint ch = 0;
+#ifdef __SSE2__
+    // both channels of a stereo pair in the low lanes
+    for (; ch + 2 <= n_channels; ch += 2) {
+        __m128 b0 = _mm_set1_ps(fx->b0);
+        __m128 b1 = _mm_set1_ps(fx->b1);
+        __m128 b2 = _mm_set1_ps(fx->b2);
+        __m128 a1 = _mm_set1_ps(fx->a1);
+        __m128 a2 = _mm_set1_ps(fx->a2);
+        __m128 z1 = _mm_setr_ps(
+                fx->z1[ch], fx->z1[ch + 1], 0, 0);
+        __m128 z2 = _mm_setr_ps(
+                fx->z2[ch], fx->z2[ch + 1], 0, 0);
+
+        for (uint i = 0; i < n_frames; i++) {
+            __m128i* frame =
+                    (__m128i*)(buf + i * n_channels + ch);
+            __m128 x = _mm_castsi128_ps(
+                    _mm_loadl_epi64(frame));
+            __m128 y = _mm_add_ps(_mm_mul_ps(b0, x), z1);
+            z1 = _mm_add_ps(
+                    _mm_sub_ps(
+                            _mm_mul_ps(b1, x),
+                            _mm_mul_ps(a1, y)),
+                    z2);
+            z2 = _mm_sub_ps(
+                    _mm_mul_ps(b2, x), _mm_mul_ps(a2, y));
+            _mm_storel_epi64(frame, _mm_castps_si128(y));
+        }
+
+        float z[4];
+        _mm_storeu_ps(z, z1);
+        fx->z1[ch] = z[0];
+        fx->z1[ch + 1] = z[1];
+        _mm_storeu_ps(z, z2);
+        fx->z2[ch] = z[0];
+        fx->z2[ch + 1] = z[1];
+    }
+#endif
+    for (; ch < n_channels; ch++) {
+        float z1 = fx->z1[ch];
+        float z2 = fx->z2[ch];
+        for (uint i = 0; i < n_frames; i++) {
+            float x = buf[i * n_channels + ch];
+            float y = fx->b0 * x + z1;
+            z1 = fx->b1 * x - fx->a1 * y + z2;
+            z2 = fx->b2 * x - fx->a2 * y;
+            buf[i * n_channels + ch] = y;
         }
+        fx->z1[ch] = z1;
+        fx->z2[ch] = z2;
     }
+}
 
-    return n_signed;
+// w = x + feedback * r, x += mix * r.  w and r never
+// overlap
+static void delay_span(
+        float* x,
+        float* w,
+        const float* r,
+        uint n,
+        float feedback,
+        float mix) {
+    uint i = 0;
+#ifdef __SSE2__
+    __m128 fb = _mm_set1_ps(feedback);
+    __m128 m = _mm_set1_ps(mix);
+    for (; i + 4 <= n; i += 4) {
+        __m128 xv = _mm_loadu_ps(x + i);
+        __m128 rv = _mm_loadu_ps(r + i);
+        __m128 wv = _mm_add_ps(xv, _mm_mul_ps(fb, rv));
+        __m128 yv = _mm_add_ps(xv, _mm_mul_ps(m, rv));
+        _mm_storeu_ps(w + i, wv);
+        _mm_storeu_ps(x + i, yv);
+    }
+#endif
+    for (; i < n; i++) {
+        w[i] = x[i] + feedback * r[i];
+        x[i] += mix * r[i];
+    }
 }
 
-static void
-state_cb(cubeb_stream* stm, void* user, cubeb_state state) {
-    (void)stm;
-    (void)user;
-    (void)state;
+static void delay_block(
+        FxInsert* fx,
+        float* buf,
+        uint n_frames,
+        uint n_channels,
+        uint sample_rate) {
+    uint size = fx->delay_frames;
+    double t = fx->cur[FX_DELAY_TIME] * (double)sample_rate;
+    uint d = t < 1 ? 1 : (uint)t;
+    if (d >= size) {
+        d = size - 1;
+    }
+    float feedback = (float)fx->cur[FX_FEEDBACK];
+    float mix = (float)fx->cur[FX_MIX];
+
+    // in spans no longer than the delay, so that nothing
+    // written in a span is read back in the same one, and
+    // that don't cross the end of the ring
+    uint done = 0;
+    while (done < n_frames) {
+        uint w = fx->delay_pos;
+        uint r = (w + size - d) % size;
+        uint m = n_frames - done;
+        m = m < d ? m : d;
+        m = m < size - w ? m : size - w;
+        m = m < size - r ? m : size - r;
+
+        delay_span(
+                buf + done * n_channels,
+                fx->delay_buf + w * n_channels,
+                fx->delay_buf + r * n_channels,
+                m * n_channels,
+                feedback,
+                mix);
+
+        fx->delay_pos = (w + m) % size;
+        done += m;
+    }
 }
 
-static void init_stream_data(StreamData* p) {
-    // TODO
-    uint ebl = 1024 * 64;
-    uint nbl = 64;
-    uint value_num = 1024;
+// rbj cookbook coefficients, from the current params
+static void biquad_coefficients(
+        FxInsert* fx,
+        uint sample_rate) {
+    double nyquist = (double)sample_rate / 2;
+    double freq = fx->cur[FX_FREQ];
+    freq = freq < 10 ? 10 : freq;
+    freq = freq > 0.95 * nyquist ? 0.95 * nyquist : freq;
+    double q = fx->cur[FX_Q] < 0.1 ? 0.1 : fx->cur[FX_Q];
+
+    double w0 = 2 * PI * freq / (double)sample_rate;
+    double cos_w0 = cos(w0);
+    double alpha = sin(w0) / (2 * q);
+
+    double b0, b1, b2;
+    switch (fx->type) {
+    case FX_LOW_PASS:
+        b0 = (1 - cos_w0) / 2;
+        b1 = 1 - cos_w0;
+        b2 = (1 - cos_w0) / 2;
+        break;
+    case FX_HIGH_PASS:
+        b0 = (1 + cos_w0) / 2;
+        b1 = -(1 + cos_w0);
+        b2 = (1 + cos_w0) / 2;
+        break;
+    case FX_BAND_PASS:
+        b0 = alpha;
+        b1 = 0;
+        b2 = -alpha;
+        break;
+    default:
+        assert(0);
+        return;
+    }
 
-    *p = (StreamData){
-            .c = 1,
-            .volume = 1.0,
+    double a0 = 1 + alpha;
+    fx->b0 = (float)(b0 / a0);
+    fx->b1 = (float)(b1 / a0);
+    fx->b2 = (float)(b2 / a0);
+    fx->a1 = (float)(-2 * cos_w0 / a0);
+    fx->a2 = (float)((1 - alpha) / a0);
+}
 
-            .setter_buf = malloc(sizeof(ValueSetter) * nbl),
-            .setter_buf_size = nbl,
+// equal power, pan only applies to the first two channels
+static void gain_pan_gains(
+        const double* params,
+        float* gains,
+        uint n_channels) {
+    double gain = params[FX_GAIN];
+    double pan = params[FX_PAN];
+    pan = pan < -1 ? -1 : (pan > 1 ? 1 : pan);
+    double angle = (pan + 1) * PI / 4;
+
+    for (uint ch = 0; ch < n_channels; ch++) {
+        gains[ch] = (float)gain;
+    }
+    if (n_channels >= 2) {
+        // sqrt(2) keeps center at unity
+        gains[0] = (float)(gain * cos(angle) * sqrt(2));
+        gains[1] = (float)(gain * sin(angle) * sqrt(2));
+    }
+}
 
-            .value_buf = malloc(sizeof(double) * value_num),
-            .value_state_buf =
-                    malloc(sizeof(ValueState) * value_num),
-            .value_name_buf =
-                    malloc(sizeof(char*) * value_num),
-            .value_buf_size = value_num,
+// runs the chain over n interleaved frames in place
+static void fx_process(
+        FxChain* chain,
+        float* buf,
+        uint n,
+        uint n_channels) {
+    if (n == 0) {
+        return;
+    }
 
-            .event_buf = malloc(sizeof(Event) * ebl),
-            .event_state_buf = malloc(
-                    sizeof(_Atomic(EventState)) * ebl),
-            .event_buf_size = ebl,
-    };
+    atomic_fetch_add(&chain->n_processing, 1);
+    FxBank* bank = atomic_load(&chain->live);
 
-    for (uint i = 0; i < value_num; i++) {
+    double smooth_frames =
+            FX_SMOOTH_SECS * (double)chain->sample_rate;
+    double alpha = 1 - exp(-(double)n / smooth_frames);
+
+    uint n_inserts = atomic_load(&bank->n_inserts);
+    for (uint i = 0; i < n_inserts; i++) {
+        FxInsert* fx = &bank->inserts[i];
+
+        double prev[FX_MAX_PARAMS];
+        for (uint j = 0; j < FX_MAX_PARAMS; j++) {
+            prev[j] = fx->cur[j];
+            double target = atomic_load_explicit(
+                    &fx->target[j], memory_order_relaxed);
+            fx->cur[j] += (target - fx->cur[j]) * alpha;
+        }
+
+        switch (fx->type) {
+        case FX_LOW_PASS:
+        case FX_HIGH_PASS:
+        case FX_BAND_PASS:
+            biquad_coefficients(fx, chain->sample_rate);
+            biquad_block(fx, buf, n, n_channels);
+            break;
+
+        case FX_GAIN_PAN: {
+            float g0[MAX_CHANNELS];
+            float g1[MAX_CHANNELS];
+            gain_pan_gains(prev, g0, n_channels);
+            gain_pan_gains(fx->cur, g1, n_channels);
+            gain_ramp_block(buf, n, n_channels, g0, g1);
+            break;
+        }
+
+        case FX_DELAY:
+            delay_block(
+                    fx,
+                    buf,
+                    n,
+                    n_channels,
+                    chain->sample_rate);
+            break;
+
+        default:
+            assert(0);
+        }
+    }
+
+    atomic_fetch_sub(&chain->n_processing, 1);
+}
+
+static bool fx_active(FxChain* chain) {
+    FxBank* bank = atomic_load(&chain->live);
+    return atomic_load(&bank->n_inserts) > 0;
+}
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 +
+           (uint64_t)ts.tv_nsec;
+}
+
+// see page_faults.c
+uint64_t thread_page_faults(void);
+
+// mixes n frames of whatever the stream is playing from
+// into out.  returns whether they've already been through
+// the stream's inserts
+static bool render_source(
+        AudioContext* ctx,
+        StreamData* p,
+        float* out,
+        uint64_t n,
+        bool audible) {
+    const float* frozen_pcm = atomic_load(&p->frozen_pcm);
+
+    if (frozen_pcm) {
+        read_frozen(
+                p,
+                frozen_pcm,
+                out,
+                n,
+                ctx->n_channels,
+                audible);
+    } else if (atomic_load(&ctx->render_thread_running) &&
+               atomic_load(&p->render_ahead)) {
+        read_ahead(ctx, p, out, n, audible);
+        return true;
+    } else if (!audible) {
+        skip_samples(p, n);
+    } else {
+        uint64_t start_ns = monotonic_ns();
+        generate_samples(
+                p,
+                out,
+                n,
+                ctx->sample_rate,
+                ctx->n_channels);
+        ctx->voices_ns += monotonic_ns() - start_ns;
+    }
+    return false;
+}
+
+// like render_source, for streams with inserts or pan,
+// which need the stream on its own first
+static void render_bus(
+        AudioContext* ctx,
+        StreamData* p,
+        float* out,
+        uint64_t n) {
+    uint nch = ctx->n_channels;
+    double smooth_frames =
+            FX_SMOOTH_SECS * (double)ctx->sample_rate;
+
+    for (uint64_t done = 0; done < n;) {
+        uint64_t m = n - done;
+        m = m < MIX_BUF_FRAMES ? m : MIX_BUF_FRAMES;
+
+        memset(p->mix_buf, 0, sizeof(float) * nch * m);
+        if (!render_source(ctx, p, p->mix_buf, m, true)) {
+            fx_process(&p->fx, p->mix_buf, m, nch);
+        }
+
+        double pan = atomic_load(&p->pan);
+        double prev[2] = {1, p->pan_cur};
+        double alpha = 1 - exp(-(double)m / smooth_frames);
+        p->pan_cur += (pan - p->pan_cur) * alpha;
+        if (fabs(pan - p->pan_cur) < 1e-6) {
+            p->pan_cur = pan;
+        }
+        double cur[2] = {1, p->pan_cur};
+
+        if (prev[1] != 0 || cur[1] != 0) {
+            float g0[MAX_CHANNELS];
+            float g1[MAX_CHANNELS];
+            gain_pan_gains(prev, g0, nch);
+            gain_pan_gains(cur, g1, nch);
+            gain_ramp_block(p->mix_buf, m, nch, g0, g1);
+        }
+
+        mix_block(out + nch * done, p->mix_buf, nch * m);
+        done += m;
+    }
+}
+
+static bool stream_audible(StreamData* p, bool any_solo) {
+    return !atomic_load(&p->muted) &&
+           (!any_solo || atomic_load(&p->solo) ||
+            atomic_load(&p->solo_safe));
+}
+
+// whether the governor should shed a voice with priority
+// a and peak a_peak before one with b and b_peak
+static bool sheds_before(
+        int a,
+        double a_peak,
+        int b,
+        double b_peak) {
+    return a < b || (a == b && a_peak < b_peak);
+}
+
+// fills victims with the up to SHED_MAX_VOICES voices the
+// governor should shed first (lowest priority stream, then
+// quietest), in order, in one pass over the streams.
+// returns how many it found, and sets n_voices to how many
+// there were to pick from.  only streams whose setters run
+// in data_cb count
+static uint voices_to_shed(
+        AudioContext* ctx,
+        VoiceState** victims,
+        uint* n_voices) {
+    bool any_solo = atomic_load(&ctx->n_solo) > 0;
+    bool ahead = atomic_load(&ctx->render_thread_running);
+
+    int priorities[SHED_MAX_VOICES];
+    uint n_found = 0;
+    *n_voices = 0;
+
+    for (uint i = 0; i < ctx->stream_data_buf_size; i++) {
+        StreamData* p = &(ctx->stream_data_buf[i]);
+        if (atomic_load(&p->slot_state) != SLOT_ACTIVE ||
+            atomic_load(&p->stream_state) !=
+                    STREAM_PLAYING ||
+            !stream_audible(p, any_solo) ||
+            atomic_load(&p->frozen_pcm) ||
+            (ahead && atomic_load(&p->render_ahead))) {
+            continue;
+        }
+
+        int priority = atomic_load(&p->priority);
+        for (uint j = 0; j < p->setter_buf_size; j++) {
+            ValueSetter* setter = &p->setter_buf[j];
+            VoiceState* voice = &p->voice_buf[j];
+            if (!setter->fn || !is_voice(p, j) ||
+                voice->fade_frames > 0) {
+                continue;
+            }
+            (*n_voices)++;
+
+            // insertion into the (short, sorted) list
+            uint k = n_found;
+            while (k > 0 &&
+                   sheds_before(
+                           priority,
+                           voice->peak,
+                           priorities[k - 1],
+                           victims[k - 1]->peak)) {
+                if (k < SHED_MAX_VOICES) {
+                    victims[k] = victims[k - 1];
+                    priorities[k] = priorities[k - 1];
+                }
+                k--;
+            }
+            if (k < SHED_MAX_VOICES) {
+                victims[k] = voice;
+                priorities[k] = priority;
+                n_found += n_found < SHED_MAX_VOICES;
+            }
+        }
+    }
+
+    return n_found;
+}
+
+// called after every callback with how long it took.  if
+// that was close to the deadline, and voices took a good
+// share of it, starts fading out enough voices to (roughly)
+// get back under it
+static void shed_voices(
+        AudioContext* ctx,
+        uint64_t n,
+        uint64_t elapsed_ns) {
+    uint64_t voices_ns = ctx->voices_ns;
+    ctx->voices_ns = 0;
+
+    if (ctx->shed_holdoff > n) {
+        ctx->shed_holdoff -= n;
+        return;
+    }
+    ctx->shed_holdoff = 0;
+
+    double deadline_ns =
+            1e9 * (double)n / (double)ctx->sample_rate;
+    double load = (double)elapsed_ns / deadline_ns;
+    if (load < SHED_LOAD_HIGH ||
+        (double)voices_ns <
+                SHED_MIN_VOICE_SHARE * (double)elapsed_ns) {
+        return;
+    }
+
+    VoiceState* victims[SHED_MAX_VOICES];
+    uint n_voices;
+    uint n_found = voices_to_shed(ctx, victims, &n_voices);
+    if (n_found == 0) {
+        return;
+    }
+
+    // the voices' share of the time, cut by however much
+    // it takes to get the whole callback down to the
+    // target, assuming each voice costs about the same
+    double excess_ns = (double)elapsed_ns -
+                       SHED_LOAD_TARGET * deadline_ns;
+    double cut = excess_ns / (double)voices_ns;
+    cut = cut < 1 ? cut : 1;
+    uint n_shed = (uint)ceil(cut * (double)n_voices);
+    n_shed = n_shed < n_found ? n_shed : n_found;
+
+    uint fade_frames =
+            get_sample_count(ctx, SHED_FADE_SECS);
+    for (uint k = 0; k < n_shed; k++) {
+        victims[k]->fade_frames = fade_frames;
+    }
+
+    atomic_fetch_add_explicit(
+            &ctx->n_voices_shed,
+            n_shed,
+            memory_order_relaxed);
+    // the next callback still pays for the fades, so it
+    // doesn't say much about the load without those voices
+    ctx->shed_holdoff = fade_frames + n;
+}
+
+// only one change is in flight at a time, later requests
+// are dropped until the render thread has applied it
+static void
+request_latency(AudioContext* ctx, uint frames) {
+    uint_fast64_t expected = 0;
+    atomic_compare_exchange_strong(
+            &ctx->latency_request, &expected, frames);
+}
+
+// counts an overrun (or not) into the current window,
+// returning whether there have been enough of them to grow
+static bool overruns_persist(
+        AudioContext* ctx,
+        uint64_t n,
+        bool overrun) {
+    if (ctx->recent_overruns > 0) {
+        ctx->overrun_window_frames += n;
+        if (ctx->overrun_window_frames >
+            get_sample_count(
+                    ctx, LATENCY_OVERRUN_WINDOW_SECS)) {
+            ctx->recent_overruns = 0;
+        }
+    }
+    if (!overrun) {
+        return false;
+    }
+
+    atomic_fetch_add_explicit(
+            &ctx->n_overruns, 1, memory_order_relaxed);
+    if (ctx->recent_overruns == 0) {
+        ctx->overrun_window_frames = 0;
+    }
+    return ++ctx->recent_overruns >= LATENCY_OVERRUNS;
+}
+
+// called after every device callback.  an xrun
+// (check_xruns saw the device run dry, or callbacks keep
+// overrunning their deadline) asks for a bigger buffer
+// straight away.  a long run of light callbacks asks for a
+// smaller one, once the output has gone quiet.  the render
+// thread does the actual restart, since a stream can't be
+// stopped from its own callback
+static void control_latency(
+        AudioContext* ctx,
+        const float* out,
+        uint64_t n,
+        uint64_t elapsed_ns) {
+    double period_ns =
+            1e9 * (double)n / (double)ctx->sample_rate;
+
+    uint xruns = atomic_load(&ctx->n_xruns);
+    bool xrun = xruns != ctx->seen_xruns;
+    ctx->seen_xruns = xruns;
+    if (overruns_persist(
+                ctx,
+                n,
+                (double)elapsed_ns > period_ns)) {
+        xrun = true;
+    }
+
+    uint latency = atomic_load(&ctx->latency_frames);
+    if (xrun) {
+        ctx->headroom_frames = 0;
+        ctx->recent_overruns = 0;
+        if (latency < ctx->max_latency_frames) {
+            uint grown = 2 * latency;
+            grown = grown < ctx->max_latency_frames
+                            ? grown
+                            : ctx->max_latency_frames;
+            request_latency(ctx, grown);
+
+            uint max_wait = get_sample_count(
+                    ctx, LATENCY_SHRINK_MAX_SECS);
+            ctx->shrink_after_frames =
+                    2 * ctx->shrink_after_frames < max_wait
+                            ? 2 * ctx->shrink_after_frames
+                            : max_wait;
+        }
+        return;
+    }
+
+    bool quiet = true;
+    uint n_samples = n * ctx->n_channels;
+    for (uint i = 0; quiet && i < n_samples; i++) {
+        quiet = fabsf(out[i]) < LATENCY_QUIET_LEVEL;
+    }
+    ctx->quiet_frames = quiet ? ctx->quiet_frames + n : 0;
+
+    if ((double)elapsed_ns >
+        LATENCY_SHRINK_LOAD * period_ns) {
+        ctx->headroom_frames = 0;
+        return;
+    }
+    ctx->headroom_frames += n;
+    if (ctx->headroom_frames < ctx->shrink_after_frames ||
+        ctx->quiet_frames <
+                get_sample_count(ctx, LATENCY_QUIET_SECS) ||
+        latency <= ctx->min_latency_frames) {
+        return;
+    }
+
+    ctx->headroom_frames = 0;
+    uint shrunk = latency / 2;
+    shrunk = shrunk > ctx->min_latency_frames
+                     ? shrunk
+                     : ctx->min_latency_frames;
+    request_latency(ctx, shrunk);
+}
+
+// called from the render thread.  the device's position
+// only gets ahead of the frames data_cb has handed it if it
+// played silence in between, i.e. it ran dry.  backends
+// whose position stops instead never report anything here,
+// which leaves persistent overruns in control_latency
+static void check_xruns(AudioContext* ctx) {
+    uint64_t position;
+    if (cubeb_stream_get_position(ctx->stream, &position) !=
+        CUBEB_OK) {
+        return;
+    }
+    // after the position, so that it's at least as new
+    uint written = atomic_load(&ctx->n_frames) -
+                   ctx->stream_start_frames;
+
+    if (position > written + ctx->position_lead) {
+        ctx->position_lead = position - written;
+        atomic_fetch_add(&ctx->n_xruns, 1);
+    }
+}
+
+static long data_cb(
+        cubeb_stream* stm,
+        void* user,
+        const void* in_s,
+        void* out_s,
+        long n_signed) {
+    (void)stm;
+    (void)in_s;
+
+    AudioContext* ctx = user;
+
+    float* out = out_s;
+    uint64_t n = (uint64_t)n_signed;
+
+    uint64_t start_ns = monotonic_ns();
+    bool count_faults =
+            atomic_load_explicit(
+                    &ctx->n_callbacks,
+                    memory_order_relaxed) %
+                    PAGE_FAULT_SAMPLE_CALLBACKS ==
+            0;
+    uint64_t start_faults =
+            count_faults ? thread_page_faults() : 0;
+
+    memset(out, 0, sizeof(float) * ctx->n_channels * n);
+
+    bool any_solo = atomic_load(&ctx->n_solo) > 0;
+
+    for (uint i = 0; i < ctx->stream_data_buf_size; i++) {
+        StreamData* p = &(ctx->stream_data_buf[i]);
+
+        SlotState slot_state = atomic_load(&p->slot_state);
+        if (slot_state == SLOT_RELEASING) {
+            atomic_store(&p->slot_state, SLOT_FREE);
+            continue;
+        }
+        if (slot_state != SLOT_ACTIVE) {
+            continue;
+        }
+
+        StreamState stream_state =
+                atomic_load(&p->stream_state);
+
+        bool audible = stream_audible(p, any_solo);
+
+        switch (stream_state) {
+        case STREAM_PLAYING:
+            if (audible &&
+                (fx_active(&p->fx) ||
+                 atomic_load(&p->pan) != 0 ||
+                 p->pan_cur != 0)) {
+                render_bus(ctx, p, out, n);
+            } else {
+                render_source(ctx, p, out, n, audible);
+            }
+            break;
+
+        case STREAM_PAUSE_NEXT_SAMPLE: {
+            bool r = atomic_compare_exchange_strong(
+                    &p->stream_state,
+                    &stream_state,
+                    STREAM_PAUSED);
+            if (!r) {
+                printf("failed to pause in data_cb?  state changed to %d",
+                       stream_state);
+            }
+        }
+        case STREAM_PAUSED:
+            break;
+
+        default:
+            assert(0);
+        }
+    }
+
+    fx_process(&ctx->master_fx, out, n, ctx->n_channels);
+
+    uint64_t elapsed_ns = monotonic_ns() - start_ns;
+    if (count_faults) {
+        atomic_fetch_add_explicit(
+                &ctx->n_callback_page_faults,
+                thread_page_faults() - start_faults,
+                memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(
+            &ctx->n_callbacks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &ctx->n_frames, n, memory_order_relaxed);
+    atomic_fetch_add_explicit(
+            &ctx->callback_ns_total,
+            elapsed_ns,
+            memory_order_relaxed);
+    if (elapsed_ns > atomic_load_explicit(
+                             &ctx->callback_ns_max,
+                             memory_order_relaxed)) {
+        atomic_store_explicit(
+                &ctx->callback_ns_max,
+                elapsed_ns,
+                memory_order_relaxed);
+    }
+
+    shed_voices(ctx, n, elapsed_ns);
+    // headless contexts are driven by render_audio, with no
+    // device to renegotiate with
+    if (stm) {
+        control_latency(ctx, out, n, elapsed_ns);
+    }
+
+    return n_signed;
+}
+
+static void
+state_cb(cubeb_stream* stm, void* user, cubeb_state state) {
+    (void)stm;
+    (void)user;
+    (void)state;
+}
+
+static int open_stream(AudioContext* ctx, uint latency) {
+    CHECK_CUBEB(cubeb_stream_init(
+            ctx->ctx,
+            &ctx->stream,
+            "sound",
+            NULL,
+            NULL,
+            NULL,
+            &ctx->output_params,
+            (uint32_t)latency,
+            data_cb,
+            state_cb,
+            ctx));
+    // a new stream's position starts over
+    ctx->stream_start_frames = atomic_load(&ctx->n_frames);
+    ctx->position_lead = 0;
+    CHECK_CUBEB(cubeb_stream_start(ctx->stream));
+
+    return 0;
+}
+
+// reopens the stream at whatever latency data_cb asked for.
+// the output drops out while it's stopped, but growing is
+// prompted by an xrun that sounded about the same, and
+// shrinking waits for silence
+static int apply_latency_request(AudioContext* ctx) {
+    uint latency = atomic_load(&ctx->latency_request);
+    if (latency == 0) {
+        return 0;
+    }
+
+    uint old_latency = atomic_load(&ctx->latency_frames);
+    CHECK_CUBEB(cubeb_stream_stop(ctx->stream));
+    cubeb_stream_destroy(ctx->stream);
+    ctx->stream = NULL;
+
+    // data_cb isn't running, so this is safe to reset
+    ctx->headroom_frames = 0;
+    ctx->quiet_frames = 0;
+    ctx->recent_overruns = 0;
+
+    atomic_store(&ctx->latency_frames, latency);
+    if (open_stream(ctx, latency) != 0) {
+        printf("couldn't reopen with latency frames %lu\n",
+               latency);
+        if (ctx->stream) {
+            cubeb_stream_destroy(ctx->stream);
+            ctx->stream = NULL;
+        }
+        latency = old_latency;
+        atomic_store(&ctx->latency_frames, latency);
+        CHECK(open_stream(ctx, latency), 0);
+    } else {
+        printf("latency frames %lu\n", latency);
+    }
+
+    atomic_fetch_add(&ctx->n_latency_changes, 1);
+    atomic_store(&ctx->latency_request, 0);
+
+    return 0;
+}
+
+// rounded up to whole cache lines
+static size_t lines_size(size_t size) {
+    size_t n_lines = (size + CACHE_LINE - 1) / CACHE_LINE;
+    return n_lines * CACHE_LINE;
+}
+
+// bytes alloc_locked couldn't lock, across every context
+// in the process (see EngineStats.n_unlocked_bytes)
+static atomic_uint_fast64_t n_unlocked_bytes;
+
+// everything the audio thread touches is allocated with
+// this, outside of it: zeroed (which faults every page in
+// up front) and locked, so rendering never page faults
+static void* alloc_locked(size_t size) {
+    static atomic_bool warned;
+
+    size = lines_size(size);
+    void* ptr = aligned_alloc(CACHE_LINE, size);
+    assert(ptr);
+    memset(ptr, 0, size);
+    // RLIMIT_MEMLOCK is often too low for this, which only
+    // makes faults possible again under memory pressure
+    if (mlock(ptr, size) != 0) {
+        atomic_fetch_add(&n_unlocked_bytes, size);
+        if (!atomic_exchange(&warned, true)) {
+            perror("mlock engine buffers");
+        }
+    }
+    return ptr;
+}
+
+static void free_locked(void* ptr, size_t size) {
+    if (ptr) {
+        size = lines_size(size);
+        if (munlock(ptr, size) != 0) {
+            atomic_fetch_sub(&n_unlocked_bytes, size);
+        }
+        free(ptr);
+    }
+}
+
+// frees a stream's copy of its frozen audio, see
+// stream_set_frozen
+static void free_frozen(
+        AudioContext* ctx,
+        const float* pcm,
+        uint n_frames) {
+    size_t size =
+            sizeof(float) * ctx->n_channels * n_frames;
+    free_locked((void*)pcm, size > 0 ? size : 1);
+}
+
+static void fx_init(
+        FxChain* chain,
+        uint sample_rate,
+        uint n_channels) {
+    chain->sample_rate = sample_rate;
+    chain->n_channels = n_channels;
+    atomic_store(&chain->banks[0].n_inserts, 0);
+    atomic_store(&chain->banks[1].n_inserts, 0);
+    atomic_store(&chain->live, &chain->banks[0]);
+    atomic_store(&chain->n_processing, 0);
+}
+
+// reserved, see VALUE_OUT_CHANNEL
+static char* out_channel_names[MAX_CHANNELS] = {
+        "out_0",
+        "out_1",
+        "out_2",
+        "out_3",
+        "out_4",
+        "out_5",
+        "out_6",
+        "out_7",
+};
+
+static void init_stream_data(
+        AudioContext* ctx,
+        StreamData* p) {
+    // TODO
+    uint ebl = 1024 * 64;
+    uint nbl = 64;
+    uint value_num = 1024;
+    uint bbl = 1024 * 16;
+
+    if (!p->event_buf) {
+        // first use of this slot.  buffers stay around
+        // after the stream is destroyed, for the next one
+        // to reuse
+        p->setter_buf =
+                alloc_locked(sizeof(ValueSetter) * nbl);
+        p->setter_buf_size = nbl;
+        p->voice_buf =
+                alloc_locked(sizeof(VoiceState) * nbl);
+
+        p->value_buf =
+                alloc_locked(sizeof(Value) * value_num);
+        p->value_state_buf = alloc_locked(
+                sizeof(ValueState) * value_num);
+        p->value_name_buf =
+                calloc(value_num, sizeof(char*));
+        p->value_buf_size = value_num;
+
+        p->event_buf =
+                alloc_locked(sizeof(EventSlot) * ebl);
+        p->event_buf_size = ebl;
+
+        p->batch_buf =
+                alloc_locked(sizeof(BatchWrite) * bbl);
+        p->batch_buf_size = bbl;
+
+        p->mix_buf = alloc_locked(
+                sizeof(float) * MAX_CHANNELS *
+                MIX_BUF_FRAMES);
+
+        pthread_mutex_init(&p->render_lock, NULL);
+    } else {
+        // the outs are static
+        for (uint i = VALUE_OUT_CHANNEL + MAX_CHANNELS;
+             i < p->value_buf_size;
+             i++) {
+            free(atomic_load(&p->value_name_buf[i]));
+        }
+    }
+
+    // the render thread might still be finishing a chunk
+    // from this slot's previous stream
+    pthread_mutex_lock(&p->render_lock);
+    atomic_store(&p->render_ahead, false);
+    atomic_store(&p->editing, false);
+    atomic_store(&p->ahead_write_pos, 0);
+    atomic_store(&p->ahead_read_pos, 0);
+    free_frozen(
+            ctx,
+            atomic_load(&p->frozen_pcm),
+            p->frozen_frames);
+    atomic_store(&p->frozen_pcm, NULL);
+    p->frozen_frames = 0;
+    pthread_mutex_unlock(&p->render_lock);
+
+    p->c = 1;
+    p->volume = 1.0;
+
+    for (uint i = 0; i < value_num; i++) {
         p->value_buf[i].d = NAN;
         p->value_state_buf[i] = VALUE_KEEP;
-        p->value_name_buf[i] = NULL;
+        atomic_store(&p->value_name_buf[i], NULL);
+    }
+    p->value_state_buf[VALUE_OUT] = VALUE_RESET;
+    atomic_store(&p->value_name_buf[VALUE_OUT], "out");
+    for (uint c = 0; c < MAX_CHANNELS; c++) {
+        uint idx = VALUE_OUT_CHANNEL + c;
+        p->value_state_buf[idx] = VALUE_RESET;
+        atomic_store(
+                &p->value_name_buf[idx],
+                out_channel_names[c]);
+    }
+
+    for (uint i = 0; i < nbl; i++) {
+        p->setter_buf[i] = EMPTY_SETTER;
+    }
+    p->n_active_setters = 0;
+
+    for (uint i = 0; i < ebl; i++) {
+        atomic_store(
+                &p->event_buf[i].state,
+                EVENT_STATE_UNINITIALIZED);
+    }
+    p->event_pos = 0;
+    atomic_store(&p->event_reserved_pos, 0);
+
+    atomic_flag_clear(&p->batch_lock);
+    atomic_store(&p->batch_reserved_pos, 0);
+    atomic_store(&p->batch_released_pos, 0);
+
+    atomic_store(&p->stream_state, STREAM_PAUSED);
+    atomic_store(&p->muted, false);
+    atomic_store(&p->solo, false);
+    atomic_store(&p->solo_safe, false);
+    atomic_store(&p->cull_threshold, VOICE_CULL_THRESHOLD);
+    atomic_store(
+            &p->cull_frames,
+            get_sample_count(ctx, VOICE_CULL_SECS));
+    atomic_store(&p->priority, 0);
+    atomic_store(&p->published_c, p->c);
+    fx_init(&p->fx, ctx->sample_rate, ctx->n_channels);
+    atomic_store(&p->pan, 0);
+    p->pan_cur = 0;
+    // n_events_processed and n_voices_culled are
+    // deliberately kept across reuse, they're only there
+    // for get_engine_stats
+}
+
+static void init_context(
+        AudioContext* ctx,
+        uint sample_rate,
+        uint latency_frames,
+        uint n_channels) {
+    *ctx = (AudioContext){
+            .sample_rate = sample_rate,
+            .min_latency_frames = latency_frames,
+            .max_latency_frames = latency_frames,
+            .n_channels = n_channels,
+    };
+
+    atomic_store(&ctx->latency_frames, latency_frames);
+    atomic_store(&ctx->latency_request, 0);
+    atomic_store(&ctx->n_latency_changes, 0);
+    atomic_store(&ctx->n_xruns, 0);
+    atomic_store(&ctx->n_overruns, 0);
+    ctx->shrink_after_frames =
+            get_sample_count(ctx, LATENCY_SHRINK_SECS);
+
+    atomic_store(&ctx->render_thread_running, false);
+    atomic_store(&ctx->n_ahead_underruns, 0);
+    atomic_store(&ctx->n_callbacks, 0);
+    atomic_store(&ctx->n_frames, 0);
+    atomic_store(&ctx->callback_ns_total, 0);
+    atomic_store(&ctx->callback_ns_max, 0);
+    atomic_store(&ctx->n_voices_shed, 0);
+    atomic_store(&ctx->n_callback_page_faults, 0);
+
+    atomic_store(&ctx->n_solo, 0);
+
+    // streams are created on demand (create_stream), the
+    // slots are just zeroed (i.e. SLOT_FREE) here
+    ctx->stream_data_buf =
+            alloc_locked(sizeof(StreamData) * MAX_STREAMS);
+    ctx->stream_data_buf_size = MAX_STREAMS;
+
+    fx_init(&ctx->master_fx, sample_rate, n_channels);
+}
+
+// renders the next RENDER_AHEAD_CHUNK frames of p into its
+// ring, using chunk (that many frames) as scratch.  called
+// with render_lock held
+static void render_ahead_chunk(
+        AudioContext* ctx,
+        StreamData* p,
+        float* chunk) {
+    uint read_pos = atomic_load(&p->ahead_read_pos);
+    uint write_pos = atomic_load(&p->ahead_write_pos);
+    if (read_pos > write_pos) {
+        // data_cb ran out and played silence for these,
+        // see read_ahead
+        skip_samples(p, read_pos - write_pos);
+        write_pos = read_pos;
+    }
+
+    uint nch = ctx->n_channels;
+    memset(chunk,
+           0,
+           sizeof(float) * nch * RENDER_AHEAD_CHUNK);
+    generate_samples(
+            p,
+            chunk,
+            RENDER_AHEAD_CHUNK,
+            ctx->sample_rate,
+            nch);
+    // here rather than at mix time, so that the
+    // EVENT_FX_PARAMs generate_samples just went through
+    // apply to the frames they were meant for
+    fx_process(&p->fx, chunk, RENDER_AHEAD_CHUNK, nch);
+
+    for (uint j = 0; j < RENDER_AHEAD_CHUNK;) {
+        uint frame = (write_pos + j) % p->ahead_buf_frames;
+        uint span = p->ahead_buf_frames - frame;
+        span = RENDER_AHEAD_CHUNK - j < span
+                       ? RENDER_AHEAD_CHUNK - j
+                       : span;
+        memcpy(p->ahead_buf + frame * nch,
+               chunk + j * nch,
+               sizeof(float) * nch * span);
+        j += span;
+    }
+    atomic_store(
+            &p->ahead_write_pos,
+            write_pos + RENDER_AHEAD_CHUNK);
+}
+
+// the render thread leaves paused streams alone, so this
+// gets a stream's first few callbacks rendered before it
+// starts playing (on whichever thread calls stream_play)
+static void prime_render_ahead(
+        AudioContext* ctx,
+        StreamData* p) {
+    if (!atomic_load(&ctx->render_thread_running) ||
+        !atomic_load(&p->render_ahead)) {
+        return;
+    }
+
+    float chunk[MAX_CHANNELS * RENDER_AHEAD_CHUNK];
+    uint prime_frames = 2 * get_latency_frames(ctx);
+
+    pthread_mutex_lock(&p->render_lock);
+    while (!atomic_load(&p->frozen_pcm) &&
+           atomic_load(&p->ahead_write_pos) <
+                   atomic_load(&p->ahead_read_pos) +
+                           prime_frames) {
+        render_ahead_chunk(ctx, p, chunk);
+    }
+    pthread_mutex_unlock(&p->render_lock);
+}
+
+static void* render_thread(void* arg) {
+    AudioContext* ctx = arg;
+    uint target_frames =
+            get_sample_count(ctx, RENDER_AHEAD_SECS);
+
+    while (atomic_load(&ctx->render_thread_running)) {
+        if (apply_latency_request(ctx) != 0) {
+            printf("lost the audio stream\n");
+            break;
+        }
+        check_xruns(ctx);
+
+        bool rendered = false;
+
+        for (uint i = 0; i < ctx->stream_data_buf_size;
+             i++) {
+            StreamData* p = &(ctx->stream_data_buf[i]);
+            if (!atomic_load(&p->render_ahead)) {
+                continue;
+            }
+
+            pthread_mutex_lock(&p->render_lock);
+            // paused streams aren't rendered: they're being
+            // cleared, requeued and scrubbed, and their
+            // setters may be about to go away.  stream_play
+            // gets them going again
+            while (atomic_load(&p->slot_state) ==
+                           SLOT_ACTIVE &&
+                   atomic_load(&p->stream_state) ==
+                           STREAM_PLAYING &&
+                   !atomic_load(&p->editing) &&
+                   atomic_load(&p->render_ahead) &&
+                   !atomic_load(&p->frozen_pcm) &&
+                   atomic_load(&p->ahead_write_pos) +
+                                   RENDER_AHEAD_CHUNK <=
+                           atomic_load(&p->ahead_read_pos) +
+                                   target_frames) {
+                render_ahead_chunk(
+                        ctx, p, ctx->render_chunk_buf);
+                rendered = true;
+            }
+            pthread_mutex_unlock(&p->render_lock);
+        }
+
+        if (!rendered) {
+            struct timespec ts = {
+                    .tv_sec = 0,
+                    .tv_nsec = 2 * 1000 * 1000,
+            };
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    return NULL;
+}
+
+void stream_set_render_ahead(
+        AudioContext* ctx,
+        uint stream_id,
+        bool render_ahead) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+
+    pthread_mutex_lock(&p->render_lock);
+    if (render_ahead && !p->ahead_buf) {
+        p->ahead_buf_frames = get_sample_count(
+                ctx, RENDER_AHEAD_BUF_SECS);
+        p->ahead_buf = alloc_locked(
+                sizeof(float) * ctx->n_channels *
+                p->ahead_buf_frames);
+    }
+    reset_render_ahead(p);
+    atomic_store(&p->render_ahead, render_ahead);
+    pthread_mutex_unlock(&p->render_lock);
+}
+
+void stream_set_frozen(
+        AudioContext* ctx,
+        uint stream_id,
+        const float* pcm,
+        uint n_frames) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    assert(atomic_load(&p->stream_state) == STREAM_PAUSED);
+
+    // data_cb reads this, so it gets a copy that can't be
+    // paged out (or still be sitting in a file)
+    float* copy = NULL;
+    if (pcm) {
+        size_t size =
+                sizeof(float) * ctx->n_channels * n_frames;
+        copy = alloc_locked(size > 0 ? size : 1);
+        memcpy(copy, pcm, size);
+    }
+
+    pthread_mutex_lock(&p->render_lock);
+    const float* old = atomic_load(&p->frozen_pcm);
+    uint old_frames = p->frozen_frames;
+    // frames counts are only read by whoever sees a
+    // non-NULL pcm, so order matters here
+    atomic_store(&p->frozen_pcm, NULL);
+    p->frozen_frames = n_frames;
+    atomic_store(&p->frozen_pcm, copy);
+    reset_render_ahead(p);
+    pthread_mutex_unlock(&p->render_lock);
+
+    // the stream is paused, so nothing's reading it
+    free_frozen(ctx, old, old_frames);
+}
+
+int render_offline(
+        AudioContext* ctx,
+        uint stream_id,
+        float* out,
+        uint n) {
+    if (!valid_stream(ctx, stream_id)) {
+        return -1;
+    }
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    if (atomic_load(&p->stream_state) != STREAM_PAUSED ||
+        atomic_load(&p->render_ahead)) {
+        return -1;
+    }
+
+    memset(out, 0, sizeof(float) * ctx->n_channels * n);
+    generate_samples(
+            p, out, n, ctx->sample_rate, ctx->n_channels);
+
+    return 0;
+}
+
+// parallel offline rendering: the timeline is split into
+// segments that are rendered concurrently, each from a copy
+// of the stream whose state at the segment start has been
+// reconstructed from events alone.  that's only exact if no
+// setter carries state across the boundary, so boundaries
+// get moved to nearby points where nothing looks to be
+// sounding, and afterwards every segment's start is checked
+// against where the previous segment really ended.
+// segments that don't match are re-rendered serially, so
+// the result is always identical to render_offline's
+
+// segments shorter than this aren't worth a thread
+#define PARALLEL_MIN_SEGMENT_SECS 1.0
+
+typedef struct {
+    // state the segment was reconstructed with
+    StreamData start;
+    // same, advanced through the segment by the worker
+    StreamData work;
+    uint from;
+    uint to;
+    float* out;
+} RenderSegment;
+
+typedef struct {
+    RenderSegment* segments;
+    uint n_segments;
+    atomic_uint_fast32_t next_segment;
+    uint sample_rate;
+    uint n_channels;
+} RenderJob;
+
+// just the parts of a stream that rendering touches.  the
+// event ring only holds the n_events that were pending when
+// the render started, followed by an uninitialized
+// sentinel, so it never wraps
+static void alloc_stream_clone(
+        StreamData* dst,
+        StreamData* src,
+        uint n_events) {
+    uint nbl = src->setter_buf_size;
+    uint value_num = src->value_buf_size;
+    uint ebl = n_events + 1;
+
+    *dst = (StreamData){
+            .setter_buf = malloc(sizeof(ValueSetter) * nbl),
+            .setter_buf_size = nbl,
+            .voice_buf = malloc(sizeof(VoiceState) * nbl),
+
+            .value_buf = malloc(sizeof(Value) * value_num),
+            .value_state_buf =
+                    malloc(sizeof(ValueState) * value_num),
+            .value_buf_size = value_num,
+
+            .event_buf = aligned_alloc(
+                    CACHE_LINE, sizeof(EventSlot) * ebl),
+            .event_buf_size = ebl,
+    };
+}
+
+static void free_stream_clone(StreamData* p) {
+    free(p->setter_buf);
+    free(p->voice_buf);
+    free(p->value_buf);
+    free(p->value_state_buf);
+    free(p->event_buf);
+}
+
+static void copy_values(StreamData* dst, StreamData* src) {
+    dst->c = src->c;
+    dst->volume = src->volume;
+    dst->n_active_setters = src->n_active_setters;
+    memcpy(dst->setter_buf,
+           src->setter_buf,
+           sizeof(ValueSetter) * src->setter_buf_size);
+    memcpy(dst->voice_buf,
+           src->voice_buf,
+           sizeof(VoiceState) * src->setter_buf_size);
+    atomic_store(
+            &dst->cull_threshold,
+            atomic_load(&src->cull_threshold));
+    atomic_store(
+            &dst->cull_frames,
+            atomic_load(&src->cull_frames));
+    memcpy(dst->value_buf,
+           src->value_buf,
+           sizeof(Value) * src->value_buf_size);
+    memcpy(dst->value_state_buf,
+           src->value_state_buf,
+           sizeof(ValueState) * src->value_buf_size);
+}
+
+// clone from the real stream, taking its first n_events
+// pending events
+static void snapshot_stream(
+        StreamData* dst,
+        StreamData* p,
+        uint n_events) {
+    assert(dst->event_buf_size == n_events + 1);
+
+    copy_values(dst, p);
+    for (uint i = 0; i < n_events; i++) {
+        uint idx = (p->event_pos + i) % p->event_buf_size;
+        dst->event_buf[i].event = p->event_buf[idx].event;
+        atomic_store(
+                &dst->event_buf[i].state,
+                EVENT_STATE_READY);
     }
-    p->value_state_buf[0] = VALUE_RESET;
-    p->value_name_buf[0] = "out";
+    atomic_store(
+            &dst->event_buf[n_events].state,
+            EVENT_STATE_UNINITIALIZED);
+    dst->event_pos = 0;
+}
 
-    for (uint i = 0; i < nbl; i++) {
-        p->setter_buf[i] = EMPTY_SETTER;
+// clone to clone.  events before event_pos are never looked
+// at again, so they aren't copied
+static void copy_stream_clone(
+        StreamData* dst,
+        StreamData* src) {
+    assert(dst->event_buf_size == src->event_buf_size);
+
+    copy_values(dst, src);
+    for (uint i = src->event_pos; i < src->event_buf_size;
+         i++) {
+        dst->event_buf[i].event = src->event_buf[i].event;
+        atomic_store(
+                &dst->event_buf[i].state,
+                atomic_load(&src->event_buf[i].state));
     }
+    dst->event_pos = src->event_pos;
+}
 
-    for (uint i = 0; i < ebl; i++) {
+static bool same_stream_state(
+        StreamData* a,
+        StreamData* b) {
+    if (a->c != b->c || a->event_pos != b->event_pos ||
+        a->n_active_setters != b->n_active_setters) {
+        return false;
+    }
+
+    for (uint i = 0; i < a->setter_buf_size; i++) {
+        ValueSetter* sa = &a->setter_buf[i];
+        ValueSetter* sb = &b->setter_buf[i];
+        if (sa->fn != sb->fn ||
+            sa->local_idxs != sb->local_idxs ||
+            sa->target_idx != sb->target_idx ||
+            sa->id != sb->id) {
+            return false;
+        }
+        // decides when it gets culled
+        VoiceState* va = &a->voice_buf[i];
+        VoiceState* vb = &b->voice_buf[i];
+        if (sa->fn &&
+            (va->quiet_frames != vb->quiet_frames ||
+             va->writes_out != vb->writes_out)) {
+            return false;
+        }
+    }
+
+    for (uint i = 0; i < a->value_buf_size; i++) {
+        if (a->value_state_buf[i] !=
+            b->value_state_buf[i]) {
+            return false;
+        }
+        // reset values are zeroed before they're next read
+        if (a->value_state_buf[i] == VALUE_KEEP &&
+            a->value_buf[i].u != b->value_buf[i].u) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// how many samples in a row before p->c setter slot i has
+// been under the cull threshold, up to max (and never
+// further back than when it started)
+static uint quiet_run(
+        StreamData* p,
+        uint i,
+        uint sample_rate,
+        uint max) {
+    double threshold = atomic_load(&p->cull_threshold);
+    uint age = p->c - p->voice_buf[i].started_at;
+    max = age < max ? age : max;
+
+    ValueInput value_input = (ValueInput){
+            .sample_rate = sample_rate,
+            .values = p->value_buf,
+    };
+
+    uint q = 0;
+    while (q < max) {
+        value_input.t = p->c - 1 - q;
+        bool expire = false;
+        double a = run_setter(
+                p,
+                i,
+                &value_input,
+                N_OUT_VALUES,
+                0,
+                &expire);
+        if (a >= threshold) {
+            break;
+        }
+        q++;
+    }
+    return q;
+}
+
+// guesses whether setter slot i would have been culled by
+// now.  a few probes spread across the window rule out most
+// voices before doing it properly
+static bool quiet_for_window(
+        StreamData* p,
+        uint i,
+        uint sample_rate) {
+    double threshold = atomic_load(&p->cull_threshold);
+    uint window = atomic_load(&p->cull_frames);
+    uint n_probes = 4;
+
+    ValueInput value_input = (ValueInput){
+            .sample_rate = sample_rate,
+            .values = p->value_buf,
+    };
+
+    for (uint k = 0; k < n_probes; k++) {
+        uint back = k * (window - 1) / (n_probes - 1);
+        value_input.t = p->c - 1 - back;
+        bool expire = false;
+        double a = run_setter(
+                p,
+                i,
+                &value_input,
+                N_OUT_VALUES,
+                0,
+                &expire);
+        if (a >= threshold) {
+            return false;
+        }
+    }
+    return quiet_run(p, i, sample_rate, window) >= window;
+}
+
+// fills in quiet_frames for a segment's start state.  the
+// walker doesn't run setters, so it doesn't know
+static void guess_quiet_frames(
+        StreamData* p,
+        uint sample_rate) {
+    uint window = atomic_load(&p->cull_frames);
+    if (window == 0 || p->c == 0) {
+        return;
+    }
+
+    for (uint i = 0; i < p->setter_buf_size; i++) {
+        ValueSetter* setter = &p->setter_buf[i];
+        if (setter->fn && is_voice(p, i)) {
+            p->voice_buf[i].quiet_frames =
+                    quiet_run(p, i, sample_rate, window);
+        }
+    }
+}
+
+// runs the setters for the sample before p->c and drops the
+// ones that say they've expired, or that are quiet and old
+// enough to have been culled.  those will (almost
+// certainly) have gone somewhere earlier in a real render,
+// and need to be gone before the next setter event picks a
+// slot.  outputs are discarded and values are read as they
+// are, so this is only a guess
+static void drop_expired_setters(
+        StreamData* p,
+        uint sample_rate) {
+    if (p->n_active_setters == 0 || p->c == 0) {
+        return;
+    }
+
+    uint cull_frames = atomic_load(&p->cull_frames);
+
+    ValueInput value_input = (ValueInput){
+            .t = p->c - 1,
+            .sample_rate = sample_rate,
+            .values = p->value_buf,
+    };
+
+    for (uint i = 0; i < p->setter_buf_size; i++) {
+        ValueSetter* setter = &p->setter_buf[i];
+        if (!setter->fn) {
+            continue;
+        }
+
+        bool expire = false;
+        run_setter(
+                p,
+                i,
+                &value_input,
+                N_OUT_VALUES,
+                0,
+                &expire);
+        uint age = p->c - p->voice_buf[i].started_at;
+        if (!expire && cull_frames > 0 && is_voice(p, i) &&
+            age >= cull_frames) {
+            expire = quiet_for_window(p, i, sample_rate);
+        }
+        if (expire) {
+            *setter = EMPTY_SETTER;
+            p->n_active_setters--;
+        }
+    }
+}
+
+// like skip_samples, but guesses at setter expiry at every
+// event, and leaves events at t unprocessed
+static void walk_samples(
+        StreamData* p,
+        uint t,
+        uint sample_rate) {
+    while (p->c < t) {
+        p->c += process_events(p, t - p->c);
+        drop_expired_setters(p, sample_rate);
+    }
+}
+
+static void* render_segments(void* arg) {
+    RenderJob* job = arg;
+
+    for (;;) {
+        uint k = atomic_fetch_add(&job->next_segment, 1);
+        if (k >= job->n_segments) {
+            return NULL;
+        }
+
+        RenderSegment* seg = &job->segments[k];
+        copy_stream_clone(&seg->work, &seg->start);
+        generate_samples(
+                &seg->work,
+                seg->out,
+                seg->to - seg->from,
+                job->sample_rate,
+                job->n_channels);
+    }
+}
+
+int render_offline_parallel(
+        AudioContext* ctx,
+        uint stream_id,
+        float* out,
+        uint n,
+        uint n_threads) {
+    if (!valid_stream(ctx, stream_id)) {
+        return -1;
+    }
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    if (atomic_load(&p->stream_state) != STREAM_PAUSED ||
+        atomic_load(&p->render_ahead)) {
+        return -1;
+    }
+
+    if (n_threads == 0) {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n_cpus > 0 ? (uint)n_cpus : 1;
+    }
+
+    uint min_segment = get_sample_count(
+            ctx, PARALLEL_MIN_SEGMENT_SECS);
+    // a couple of segments per thread, to even out the load
+    uint n_segments = 2 * n_threads;
+    if (n / min_segment < n_segments) {
+        n_segments = n / min_segment;
+    }
+
+    // jumps make "the state at sample t" ambiguous, so
+    // streams with them just get rendered serially
+    uint n_events = 0;
+    bool has_reset = false;
+    while (n_events < p->event_buf_size) {
+        uint idx = (p->event_pos + n_events) %
+                   p->event_buf_size;
+        EventSlot* slot = &p->event_buf[idx];
+        if (atomic_load(&slot->state) !=
+            EVENT_STATE_READY) {
+            break;
+        }
+        if (slot->event.type == EVENT_RESET_STREAM) {
+            has_reset = true;
+        }
+        n_events++;
+    }
+
+    if (n_threads < 2 || n_segments < 2 || has_reset) {
+        return render_offline(ctx, stream_id, out, n);
+    }
+
+    uint nch = ctx->n_channels;
+    memset(out, 0, sizeof(float) * nch * n);
+
+    // StreamData is cache line aligned
+    RenderSegment* segments = aligned_alloc(
+            CACHE_LINE, sizeof(RenderSegment) * n_segments);
+    memset(segments, 0, sizeof(RenderSegment) * n_segments);
+
+    // walks the timeline applying events only, handing out
+    // start states as it passes segment boundaries
+    StreamData walker;
+    alloc_stream_clone(&walker, p, n_events);
+    snapshot_stream(&walker, p, n_events);
+
+    uint start = p->c;
+    uint nominal_len = n / n_segments;
+    for (uint k = 0; k < n_segments; k++) {
+        RenderSegment* seg = &segments[k];
+        alloc_stream_clone(&seg->start, p, n_events);
+        alloc_stream_clone(&seg->work, p, n_events);
+
+        if (k == 0) {
+            copy_stream_clone(&seg->start, &walker);
+            seg->from = start;
+            continue;
+        }
+
+        // candidates are the nominal boundary and every
+        // event within a quarter segment of it, since
+        // events are where notes start.  the first one
+        // where nothing is sounding wins, otherwise the
+        // nominal one is used
+        uint nominal = start + k * nominal_len;
+        uint window_start = nominal - nominal_len / 4;
+        uint window_end = nominal + nominal_len / 4;
+        if (window_start <= segments[k - 1].from) {
+            window_start = segments[k - 1].from + 1;
+        }
+
+        uint t = walker.c > window_start ? walker.c
+                                         : window_start;
+        bool found = false;
+        while (t <= window_end && !found) {
+            walk_samples(&walker, t, ctx->sample_rate);
+            found = walker.n_active_setters == 0;
+
+            if (found || t == nominal) {
+                copy_stream_clone(&seg->start, &walker);
+                seg->from = t;
+            }
+
+            uint next = window_end + 1;
+            EventSlot* slot =
+                    &walker.event_buf[walker.event_pos];
+            if (atomic_load(&slot->state) ==
+                EVENT_STATE_READY) {
+                uint at = slot->event.at_count;
+                next = at > t ? at : t + 1;
+            }
+            if (t < nominal && nominal < next) {
+                next = nominal;
+            }
+            t = next;
+        }
+
+        if (seg->from == 0) {
+            // the previous boundary was moved past this
+            // one's nominal point
+            copy_stream_clone(&seg->start, &walker);
+            seg->from = walker.c;
+        }
+        guess_quiet_frames(&seg->start, ctx->sample_rate);
+    }
+
+    for (uint k = 0; k < n_segments; k++) {
+        RenderSegment* seg = &segments[k];
+        seg->to = k + 1 < n_segments ? segments[k + 1].from
+                                     : start + n;
+        seg->out = out + nch * (seg->from - start);
+        assert(seg->to >= seg->from);
+    }
+
+    RenderJob job = {
+            .segments = segments,
+            .n_segments = n_segments,
+            .sample_rate = ctx->sample_rate,
+            .n_channels = nch,
+    };
+    atomic_store(&job.next_segment, 0);
+
+    // this thread works too
+    uint n_workers =
+            n_threads < n_segments ? n_threads : n_segments;
+    n_workers--;
+    pthread_t* workers =
+            malloc(sizeof(pthread_t) * n_workers);
+    uint n_started = 0;
+    for (uint i = 0; i < n_workers; i++) {
+        if (pthread_create(
+                    &workers[i],
+                    NULL,
+                    render_segments,
+                    &job) != 0) {
+            break;
+        }
+        n_started++;
+    }
+    render_segments(&job);
+    for (uint i = 0; i < n_started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    // a segment whose start doesn't match where the
+    // previous one ended gets redone from the real state,
+    // which can cascade into the next one
+    uint n_redone = 0;
+    for (uint k = 1; k < n_segments; k++) {
+        RenderSegment* prev = &segments[k - 1];
+        RenderSegment* seg = &segments[k];
+        if (same_stream_state(&prev->work, &seg->start)) {
+            continue;
+        }
+
+        n_redone++;
+        atomic_store(&seg->work.n_voices_culled, 0);
+        memset(seg->out,
+               0,
+               sizeof(float) * nch * (seg->to - seg->from));
+        copy_stream_clone(&seg->work, &prev->work);
+        generate_samples(
+                &seg->work,
+                seg->out,
+                seg->to - seg->from,
+                ctx->sample_rate,
+                nch);
+    }
+
+    printf("rendered %lu segments on %lu threads, %lu redone\n",
+           n_segments,
+           n_started + 1,
+           n_redone);
+
+    // leave the stream where render_offline would have
+    StreamData* end = &segments[n_segments - 1].work;
+    for (uint i = 0; i < end->event_pos; i++) {
+        uint idx = (p->event_pos + i) % p->event_buf_size;
+        Event* e = &p->event_buf[idx].event;
+        if (e->type == EVENT_WRITE_BATCH) {
+            release_batch(p, e->batch.arena_end);
+        }
+        if (e->type == EVENT_FX_PARAM) {
+            // skipped by the clones, see process_events
+            fx_set_param(
+                    &p->fx,
+                    e->fx.slot,
+                    e->fx.param,
+                    e->fx.value);
+        }
+        e->at_count = end->event_buf[i].event.at_count;
         atomic_store(
-                &p->event_state_buf[i],
-                EVENT_STATE_UNINITIALIZED);
+                &p->event_buf[idx].state,
+                EVENT_STATE_PROCESSED);
     }
-    atomic_store(&p->event_pos, 0);
-    atomic_store(&p->event_reserved_pos, 0);
+    atomic_fetch_add_explicit(
+            &p->n_events_processed,
+            end->event_pos,
+            memory_order_relaxed);
+    p->event_pos = (p->event_pos + end->event_pos) %
+                   p->event_buf_size;
+    copy_values(p, end);
+    atomic_store(&p->published_c, p->c);
+
+    uint n_culled = 0;
+    for (uint k = 0; k < n_segments; k++) {
+        n_culled += atomic_load(
+                &segments[k].work.n_voices_culled);
+    }
+    atomic_fetch_add_explicit(
+            &p->n_voices_culled,
+            n_culled,
+            memory_order_relaxed);
+
+    for (uint k = 0; k < n_segments; k++) {
+        free_stream_clone(&segments[k].start);
+        free_stream_clone(&segments[k].work);
+    }
+    free(segments);
+    free_stream_clone(&walker);
 
-    atomic_store(&p->stream_state, STREAM_PAUSED);
+    return 0;
+}
+
+int create_stream(AudioContext* ctx) {
+    for (uint i = 0; i < ctx->stream_data_buf_size; i++) {
+        StreamData* p = &(ctx->stream_data_buf[i]);
+
+        SlotState expected = SLOT_FREE;
+        if (!atomic_compare_exchange_strong(
+                    &p->slot_state,
+                    &expected,
+                    SLOT_INITIALIZING)) {
+            continue;
+        }
+
+        // a try_add_event that saw the old stream active
+        // might still be writing to it
+        while (atomic_load(&p->n_adding) > 0) {
+            struct timespec ts = {
+                    .tv_sec = 0,
+                    .tv_nsec = 100 * 1000,
+            };
+            nanosleep(&ts, NULL);
+        }
+
+        init_stream_data(ctx, p);
+        atomic_store(&p->slot_state, SLOT_ACTIVE);
+        return (int)i;
+    }
+
+    printf("out of streams\n");
+    return -1;
+}
+
+void destroy_stream(AudioContext* ctx, uint stream_id) {
+    assert(valid_stream(ctx, stream_id));
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+
+    stream_set_solo(ctx, stream_id, false);
+
+    // the audio thread frees the slot (without touching
+    // anything else) the next time it sees it, so a
+    // destroyed stream can't be reinitialized out from
+    // under it
+    atomic_store(&p->slot_state, SLOT_RELEASING);
+}
+
+void stream_set_mute(
+        AudioContext* ctx,
+        uint stream_id,
+        bool muted) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    atomic_store(&p->muted, muted);
+}
+
+void stream_set_solo(
+        AudioContext* ctx,
+        uint stream_id,
+        bool solo) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    bool was_solo = atomic_exchange(&p->solo, solo);
+    if (solo && !was_solo) {
+        atomic_fetch_add(&ctx->n_solo, 1);
+    } else if (!solo && was_solo) {
+        atomic_fetch_sub(&ctx->n_solo, 1);
+    }
+}
+
+void stream_set_solo_safe(
+        AudioContext* ctx,
+        uint stream_id,
+        bool solo_safe) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    atomic_store(&p->solo_safe, solo_safe);
+}
+
+void stream_set_pan(
+        AudioContext* ctx,
+        uint stream_id,
+        double pan) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    pan = pan < -1 ? -1 : (pan > 1 ? 1 : pan);
+    atomic_store(&p->pan, pan);
+}
+
+void stream_set_voice_cull(
+        AudioContext* ctx,
+        uint stream_id,
+        double threshold,
+        double window_secs) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    uint frames = 0;
+    if (threshold > 0) {
+        frames = get_sample_count(ctx, window_secs);
+    }
+    atomic_store(&p->cull_threshold, threshold);
+    atomic_store(&p->cull_frames, frames);
+}
+
+void stream_set_priority(
+        AudioContext* ctx,
+        uint stream_id,
+        int priority) {
+    StreamData* p = &(ctx->stream_data_buf[stream_id]);
+    atomic_store(&p->priority, priority);
+}
+
+FxChain* stream_fx(AudioContext* ctx, uint stream_id) {
+    assert(valid_stream(ctx, stream_id));
+    return &(ctx->stream_data_buf[stream_id].fx);
+}
+
+FxChain* master_fx(AudioContext* ctx) {
+    return &ctx->master_fx;
+}
+
+// resets an insert for a new chain, reusing its delay_buf
+static void fx_insert_init(
+        FxChain* chain,
+        FxInsert* fx,
+        FxType type) {
+    fx->type = type;
+
+    double defaults[FX_MAX_PARAMS] = {0};
+    switch (type) {
+    case FX_LOW_PASS:
+    case FX_HIGH_PASS:
+    case FX_BAND_PASS:
+        defaults[FX_FREQ] = 1000;
+        defaults[FX_Q] = 1 / sqrt(2);
+        for (uint ch = 0; ch < MAX_CHANNELS; ch++) {
+            fx->z1[ch] = 0;
+            fx->z2[ch] = 0;
+        }
+        break;
+
+    case FX_GAIN_PAN:
+        defaults[FX_GAIN] = 1;
+        defaults[FX_PAN] = 0;
+        break;
+
+    case FX_DELAY: {
+        defaults[FX_DELAY_TIME] = 0.25;
+        defaults[FX_FEEDBACK] = 0.3;
+        defaults[FX_MIX] = 0.3;
+
+        uint frames = (uint)round(
+                              (double)chain->sample_rate *
+                              FX_MAX_DELAY_SECS) +
+                      1;
+        if (fx->delay_frames != frames) {
+            free_locked(
+                    fx->delay_buf,
+                    sizeof(float) * chain->n_channels *
+                            fx->delay_frames);
+            fx->delay_buf = alloc_locked(
+                    sizeof(float) * chain->n_channels *
+                    frames);
+            fx->delay_frames = frames;
+        }
+        memset(fx->delay_buf,
+               0,
+               sizeof(float) * chain->n_channels * frames);
+        fx->delay_pos = 0;
+        break;
+    }
+
+    default:
+        assert(0);
+    }
+
+    // no smoothing in from wherever the last insert in this
+    // slot was
+    for (uint j = 0; j < FX_MAX_PARAMS; j++) {
+        fx->cur[j] = defaults[j];
+        atomic_store(&fx->target[j], defaults[j]);
+    }
+}
+
+int fx_set_inserts(
+        FxChain* chain,
+        const FxType* types,
+        uint n_types) {
+    if (n_types > FX_MAX_INSERTS) {
+        printf("too many inserts (%lu)\n", n_types);
+        return -1;
+    }
+
+    FxBank* live = atomic_load(&chain->live);
+    FxBank* next = &chain->banks[live == &chain->banks[0]];
+    for (uint i = 0; i < n_types; i++) {
+        fx_insert_init(chain, &next->inserts[i], types[i]);
+    }
+    atomic_store(&next->n_inserts, n_types);
+
+    atomic_store(&chain->live, next);
+    // whoever is still inside fx_process might have loaded
+    // the old bank, which the next call builds into
+    while (atomic_load(&chain->n_processing) > 0) {
+        struct timespec ts = {
+                .tv_sec = 0,
+                .tv_nsec = 100 * 1000,
+        };
+        nanosleep(&ts, NULL);
+    }
+    return 0;
+}
+
+void fx_set_param(
+        FxChain* chain,
+        int slot,
+        int param,
+        double value) {
+    if (slot < 0 || param < 0 || param >= FX_MAX_PARAMS) {
+        printf("bad fx param %d.%d\n", slot, param);
+        return;
+    }
+    // the chain may have changed since an EVENT_FX_PARAM
+    // was queued
+    FxBank* bank = atomic_load(&chain->live);
+    if ((uint)slot >= atomic_load(&bank->n_inserts)) {
+        return;
+    }
+
+    atomic_store_explicit(
+            &bank->inserts[slot].target[param],
+            value,
+            memory_order_relaxed);
 }
 
 int start_audio(AudioContext** ctx) {
-    *ctx = malloc(sizeof(AudioContext));
-    cubeb_init(&((*ctx)->ctx), "musicator", NULL);
+    AudioConfig config = {
+            .n_channels = 2,
+    };
+    return start_audio_config(ctx, &config);
+}
+
+int start_audio_config(
+        AudioContext** ctx,
+        const AudioConfig* config) {
+    uint n_channels = config->n_channels;
+    if (n_channels < 1 || n_channels > MAX_CHANNELS) {
+        printf("unsupported channel count %lu\n", n_channels);
+        return -1;
+    }
+
+    cubeb* cubeb_ctx;
+    cubeb_init(&cubeb_ctx, "musicator", NULL);
     uint32_t sample_rate;
     uint32_t latency_frames;
+    uint32_t max_channels;
 
     cubeb_stream_params output_params = {0};
 
     CHECK_CUBEB(cubeb_get_preferred_sample_rate(
-            (*ctx)->ctx, &sample_rate));
-    (*ctx)->sample_rate = sample_rate;
+            cubeb_ctx, &sample_rate));
     printf("sample rate %u\n", sample_rate);
 
+    CHECK_CUBEB(cubeb_get_max_channel_count(
+            cubeb_ctx, &max_channels));
+    if (n_channels > max_channels) {
+        printf("device only has %u channels\n", max_channels);
+        cubeb_destroy(cubeb_ctx);
+        return -1;
+    }
+
     output_params.format = CUBEB_SAMPLE_FLOAT32NE;
     output_params.rate = sample_rate;
-    output_params.channels = 2;
-    output_params.layout = CUBEB_LAYOUT_STEREO;
+    output_params.channels = (uint32_t)n_channels;
+    switch (n_channels) {
+    case 1:
+        output_params.layout = CUBEB_LAYOUT_MONO;
+        break;
+    case 2:
+        output_params.layout = CUBEB_LAYOUT_STEREO;
+        break;
+    default:
+        // let the backend pick
+        output_params.layout = CUBEB_LAYOUT_UNDEFINED;
+        break;
+    }
     output_params.prefs = CUBEB_STREAM_PREF_NONE;
 
     CHECK_CUBEB(cubeb_get_min_latency(
-            (*ctx)->ctx, &output_params, &latency_frames));
+            cubeb_ctx, &output_params, &latency_frames));
     printf("latency frames %u\n", latency_frames);
 
-    uint n_stream_data = 2;
-    (*ctx)->stream_data_buf =
-            malloc(sizeof(StreamData) * n_stream_data);
-    (*ctx)->stream_data_buf_size = n_stream_data;
-    for (uint i = 0; i < n_stream_data; i++) {
-        init_stream_data(&((*ctx)->stream_data_buf[i]));
+    *ctx = alloc_locked(sizeof(AudioContext));
+    init_context(
+            *ctx, sample_rate, latency_frames, n_channels);
+    (*ctx)->ctx = cubeb_ctx;
+    (*ctx)->output_params = output_params;
+    // the minimum is where we start, the controller only
+    // ever moves up from there (and back)
+    uint max_latency =
+            get_sample_count(*ctx, LATENCY_MAX_SECS);
+    (*ctx)->max_latency_frames =
+            max_latency > latency_frames ? max_latency
+                                         : latency_frames;
+
+    (*ctx)->render_chunk_buf = alloc_locked(
+            sizeof(float) * n_channels *
+            RENDER_AHEAD_CHUNK);
+    // the render thread polls the stream's position, so
+    // the stream goes first
+    CHECK(open_stream(*ctx, latency_frames), 0);
+
+    atomic_store(&(*ctx)->render_thread_running, true);
+    CHECK(pthread_create(
+                  &(*ctx)->render_thread,
+                  NULL,
+                  render_thread,
+                  *ctx),
+          0);
+
+    return 0;
+}
+
+int start_audio_headless(
+        AudioContext** ctx,
+        uint sample_rate,
+        uint block_frames,
+        uint n_channels) {
+    if (n_channels < 1 || n_channels > MAX_CHANNELS) {
+        printf("unsupported channel count %lu\n", n_channels);
+        return -1;
     }
 
-    CHECK_CUBEB(cubeb_stream_init(
-            (*ctx)->ctx,
-            &((*ctx)->stream),
-            "sound",
-            NULL,
-            NULL,
-            NULL,
-            &output_params,
-            latency_frames,
-            data_cb,
-            state_cb,
-            *ctx));
-    CHECK_CUBEB(cubeb_stream_start((*ctx)->stream));
+    *ctx = alloc_locked(sizeof(AudioContext));
+    init_context(
+            *ctx, sample_rate, block_frames, n_channels);
 
     return 0;
 }
 
+void render_audio(AudioContext* ctx, float* out, uint n) {
+    assert(!ctx->stream);
+    data_cb(NULL, ctx, NULL, out, (long)n);
+}
+
+void get_engine_stats(
+        AudioContext* ctx,
+        EngineStats* stats) {
+    uint n_events = 0;
+    uint n_culled = 0;
+    for (uint i = 0; i < ctx->stream_data_buf_size; i++) {
+        StreamData* p = &ctx->stream_data_buf[i];
+        n_events += atomic_load(&p->n_events_processed);
+        n_culled += atomic_load(&p->n_voices_culled);
+    }
+
+    *stats = (EngineStats){
+            .n_ahead_underruns =
+                    atomic_load(&ctx->n_ahead_underruns),
+            .n_callbacks = atomic_load(&ctx->n_callbacks),
+            .n_frames = atomic_load(&ctx->n_frames),
+            .n_events = n_events,
+            .callback_ns_total =
+                    atomic_load(&ctx->callback_ns_total),
+            .callback_ns_max =
+                    atomic_load(&ctx->callback_ns_max),
+            .n_voices_culled = n_culled,
+            .n_voices_shed =
+                    atomic_load(&ctx->n_voices_shed),
+            .n_callback_page_faults = atomic_load(
+                    &ctx->n_callback_page_faults),
+            .n_unlocked_bytes =
+                    atomic_load(&n_unlocked_bytes),
+            .n_xruns = atomic_load(&ctx->n_xruns),
+            .n_overruns = atomic_load(&ctx->n_overruns),
+            .n_latency_changes =
+                    atomic_load(&ctx->n_latency_changes),
+    };
+}
+
 int stop_audio(AudioContext* ctx) {
-    CHECK_CUBEB(cubeb_stream_stop(ctx->stream));
-    cubeb_stream_destroy(ctx->stream);
-    cubeb_destroy(ctx->ctx);
+    // the render thread goes first, since it may be in the
+    // middle of reopening the stream.  render-ahead streams
+    // are rendered inline once it's stopped
+    if (atomic_exchange(
+                &ctx->render_thread_running, false)) {
+        pthread_join(ctx->render_thread, NULL);
+    }
+    if (ctx->stream) {
+        CHECK_CUBEB(cubeb_stream_stop(ctx->stream));
+        cubeb_stream_destroy(ctx->stream);
+    }
+    if (ctx->ctx) {
+        cubeb_destroy(ctx->ctx);
+    }
     free(ctx);
 
     return 0;
@@ -19,6 +19,16 @@ typedef union {
     uint64_t u;
 } Value;
 
+#define MAX_CHANNELS 8
+
+// values every stream starts out with.  setters targeting
+// VALUE_OUT are heard on every channel, and ones targeting
+// VALUE_OUT_CHANNEL + c only on channel c
+enum {
+    VALUE_OUT = 0,
+    VALUE_OUT_CHANNEL = 1,
+};
+
 typedef struct {
     uint t;
     uint sample_rate;
@@ -49,8 +59,28 @@ typedef enum {
     EVENT_WRITE,
     EVENT_WRITE_TIME,
     EVENT_RESET_STREAM,
+    // writes value to range_len consecutive targets
+    // starting at target_idx
+    EVENT_WRITE_RANGE,
+    // applies an array of writes in one go, see
+    // add_write_batch
+    EVENT_WRITE_BATCH,
+    // sets a parameter of one of the stream's inserts, see
+    // fx_set_param
+    EVENT_FX_PARAM,
 } EventType;
 
+typedef enum {
+    BATCH_WRITE_VALUE,
+    BATCH_WRITE_TIME,
+} BatchWriteType;
+
+typedef struct {
+    int target_idx;
+    BatchWriteType type;
+    Value value;
+} BatchWrite;
+
 typedef struct {
     EventType type;
     union {
@@ -58,7 +88,20 @@ typedef struct {
         struct {
             int target_idx;
             Value value;
+            uint range_len;
         };
+        struct {
+            const BatchWrite* writes;
+            uint n_writes;
+            // position in the stream's batch arena to
+            // release once processed
+            uint arena_end;
+        } batch;
+        struct {
+            int slot;
+            int param;
+            double value;
+        } fx;
         uint to_count;
     };
 
@@ -68,6 +111,20 @@ typedef struct {
 typedef struct AudioContext AudioContext;
 
 uint get_sample_count(AudioContext* ctx, double time);
+// sample count the stream has rendered up to, safe to call
+// from any thread (only advances once per audio callback)
+uint get_stream_count(AudioContext* ctx, uint stream_id);
+// current output latency.  it starts at the device minimum
+// and is raised on xruns (and lowered again after a long
+// stretch of headroom, while the output is silent) while
+// running, so anything scheduling live events should ask
+// again rather than keep it around
+uint get_latency_frames(AudioContext* ctx);
+uint get_sample_rate(AudioContext* ctx);
+// every buffer of frames the engine takes or hands out has
+// this many interleaved channels
+uint get_channel_count(AudioContext* ctx);
+bool valid_stream(AudioContext* ctx, uint stream_id);
 
 // TODO at some point going to need some sort of toposort to
 // figure out dependencies between different values (which
@@ -78,22 +135,258 @@ int get_name_idx(
         AudioContext* ctx,
         uint stream_id,
         const char* name);
+// NULL if nothing has claimed idx yet
+const char* get_name(
+        AudioContext* ctx,
+        uint stream_id,
+        int idx);
 void add_event(
         AudioContext* ctx,
         uint stream_id,
         const Event* event);
+// for callers that can't trust stream_id to still be live
+// (or that it's valid at all): checks the stream and queues
+// the event as one step, and refuses rather than overwrite
+// an event that hasn't been processed.  false if nothing
+// was queued
+bool try_add_event(
+        AudioContext* ctx,
+        uint stream_id,
+        const Event* event);
+// copies writes into the stream's preallocated batch arena
+// and queues them as a single EVENT_WRITE_BATCH (falling
+// back to one event per write if the arena is full).  a
+// scrub or reset back past a batch whose space has been
+// reused since skips it
+void add_write_batch(
+        AudioContext* ctx,
+        uint stream_id,
+        const BatchWrite* writes,
+        uint n_writes,
+        uint at_count);
 void clear_events(AudioContext* ctx, uint stream_id);
 
+// streams are independent timelines, each with its own
+// events, setters and values.  -1 if out of streams
+int create_stream(AudioContext* ctx);
+void destroy_stream(AudioContext* ctx, uint stream_id);
+
+// muted streams (and, while any stream is soloed, streams
+// that aren't) keep time and process events, but don't run
+// setters
+void stream_set_mute(
+        AudioContext* ctx,
+        uint stream_id,
+        bool muted);
+void stream_set_solo(
+        AudioContext* ctx,
+        uint stream_id,
+        bool solo);
+// solo-safe streams keep playing while others are soloed
+// (they can still be muted), e.g. live input
+void stream_set_solo_safe(
+        AudioContext* ctx,
+        uint stream_id,
+        bool solo_safe);
+// -1 (left) to 1 (right), applied when the stream is mixed
+// in, after its inserts.  only affects the first two
+// channels
+void stream_set_pan(
+        AudioContext* ctx,
+        uint stream_id,
+        double pan);
+// setters writing to an out value are retired once their
+// output has stayed below threshold (absolute) for
+// window_secs, as if they'd set expire themselves.
+// threshold 0 turns it off
+void stream_set_voice_cull(
+        AudioContext* ctx,
+        uint stream_id,
+        double threshold,
+        double window_secs);
+// when the audio callback gets close to its deadline,
+// voices are faded out and retired, lowest priority streams
+// first and the quietest voices first within those.  only
+// streams synthesized in the callback itself are affected,
+// not render-ahead, frozen or offline rendering.  default 0
+void stream_set_priority(
+        AudioContext* ctx,
+        uint stream_id,
+        int priority);
+
+// for streams whose events are all known in advance: a
+// background thread renders them a few hundred ms ahead,
+// and the audio callback only copies the result.  scrubbing
+// or clearing events throws away whatever was rendered.  no
+// effect on headless contexts
+void stream_set_render_ahead(
+        AudioContext* ctx,
+        uint stream_id,
+        bool render_ahead);
+
+// plays back pcm (n_frames frames, indexed by the stream's
+// sample count) instead of running setters, until called
+// again with NULL.  pcm is copied into locked memory, so
+// the caller can let go of it (and the audio thread never
+// waits on it being paged in).  stream must be paused
+void stream_set_frozen(
+        AudioContext* ctx,
+        uint stream_id,
+        const float* pcm,
+        uint n_frames);
+
+// renders n frames of a paused, non-render-ahead stream
+// from its current position, outside of the audio callback
+int render_offline(
+        AudioContext* ctx,
+        uint stream_id,
+        float* out,
+        uint n);
+// same result as render_offline, rendered in segments
+// across n_threads threads (0 for one per cpu).  falls back
+// to render_offline for short renders and streams that jump
+int render_offline_parallel(
+        AudioContext* ctx,
+        uint stream_id,
+        float* out,
+        uint n,
+        uint n_threads);
+
 void stream_play(AudioContext* ctx, uint stream_id);
 void stream_pause(AudioContext* ctx, uint stream_id);
 void stream_scrub(
         AudioContext* ctx,
         uint stream_id,
         double to_time);
+// brackets a series of changes to a paused stream (e.g.
+// clear_events, adding its events back, stream_scrub) that
+// the render thread mustn't see half-done
+void stream_begin_edit(AudioContext* ctx, uint stream_id);
+void stream_end_edit(AudioContext* ctx, uint stream_id);
 
+typedef struct {
+    // 1 to MAX_CHANNELS
+    uint n_channels;
+} AudioConfig;
+
+// stereo
 int start_audio(AudioContext** ctx);
+int start_audio_config(
+        AudioContext** ctx,
+        const AudioConfig* config);
+// no audio device, nothing is rendered until render_audio
+// is called (block_frames stands in for the device latency)
+int start_audio_headless(
+        AudioContext** ctx,
+        uint sample_rate,
+        uint block_frames,
+        uint n_channels);
 int stop_audio(AudioContext* ctx);
 
+// renders n frames into out, headless contexts only
+void render_audio(AudioContext* ctx, float* out, uint n);
+
+typedef struct {
+    // data_cb needed more from a render-ahead stream than
+    // had been rendered
+    uint n_ahead_underruns;
+    uint n_callbacks;
+    uint n_frames;
+    // across all streams
+    uint n_events;
+    uint callback_ns_total;
+    uint callback_ns_max;
+    // see stream_set_voice_cull and stream_set_priority
+    uint n_voices_culled;
+    uint n_voices_shed;
+    // taken by the audio thread inside the callback (linux
+    // only, and only counted in a sample of callbacks).
+    // engine buffers are locked in memory up front, so this
+    // should stay at 0 as long as n_unlocked_bytes does
+    uint n_callback_page_faults;
+    // engine buffers that couldn't be locked in memory
+    // (RLIMIT_MEMLOCK is often too low), across the process
+    uint n_unlocked_bytes;
+    // times the device's position showed it had run dry,
+    // callbacks that overran their deadline (which only
+    // change the latency when they keep happening), and how
+    // many times the latency was changed in response (see
+    // get_latency_frames).  always 0 when headless
+    uint n_xruns;
+    uint n_overruns;
+    uint n_latency_changes;
+} EngineStats;
+
+void get_engine_stats(
+        AudioContext* ctx,
+        EngineStats* stats);
+
+// shared-memory event ring for other local processes, see
+// include/musicator_control.h for the client side
+typedef struct ControlServer ControlServer;
+
+int control_start(
+        AudioContext* ctx,
+        const char* name,
+        ControlServer** server);
+int control_stop(ControlServer* server);
+
+// inserts: effects run on a stream's whole output (or the
+// master bus) a block at a time, after setters.  they're
+// applied at mix time, so frozen streams go through them
+// too, and render_offline output is dry.  render-ahead
+// streams run them on the render thread instead, so that
+// EVENT_FX_PARAMs line up with the audio around them
+typedef enum {
+    // biquads, params FX_FREQ (hz) and FX_Q
+    FX_LOW_PASS,
+    FX_HIGH_PASS,
+    FX_BAND_PASS,
+    // params FX_GAIN (linear) and FX_PAN (-1 to 1, first
+    // two channels only)
+    FX_GAIN_PAN,
+    // params FX_DELAY_TIME (seconds, up to 2), FX_FEEDBACK
+    // and FX_MIX
+    FX_DELAY,
+} FxType;
+
+enum {
+    FX_FREQ = 0,
+    FX_Q = 1,
+
+    FX_GAIN = 0,
+    FX_PAN = 1,
+
+    FX_DELAY_TIME = 0,
+    FX_FEEDBACK = 1,
+    FX_MIX = 2,
+};
+
+typedef struct FxChain FxChain;
+
+FxChain* stream_fx(AudioContext* ctx, uint stream_id);
+FxChain* master_fx(AudioContext* ctx);
+// replaces the chain with fresh inserts of the given types
+// and default params, in order.  the new chain is built
+// while the old one keeps playing, then swapped in, so this
+// waits for the audio thread to be done with the old one.
+// call it from one thread at a time.  returns -1 if there
+// are more than FX_MAX_INSERTS
+int fx_set_inserts(
+        FxChain* chain,
+        const FxType* types,
+        uint n_types);
+// safe to call from any thread.  changes are smoothed over
+// the next few blocks.  EVENT_FX_PARAM does the same at a
+// point in the stream's timeline.  on render-ahead streams
+// either is only heard once the audio rendered after it
+// reaches the output
+void fx_set_param(
+        FxChain* chain,
+        int slot,
+        int param,
+        double value);
+
 double low_pass_filter(
         double last_sample,
         double current_sample,